@@ -0,0 +1,45 @@
+#include "bench.inc"
+
+#define SAMPLES 1000000
+
+static PIF_Rgb samples[SAMPLES];
+static uint8_t results[SAMPLES];
+
+int main(void) {
+	srand(0);
+	for (int i = 0; i < SAMPLES; ++ i) {
+		samples[i].r = rand() % 256;
+		samples[i].g = rand() % 256;
+		samples[i].b = rand() % 256;
+	}
+
+	printf("%-16s %12s %12s %12s %9s\n", "palette", "scan (ms)", "index (ms)", "build (ms)", "speedup");
+	for (int i = 0; i < arraySize(palettes); ++ i) {
+		PIF_Palette *pal = loadPalette(palettes[i]);
+
+		double scan, index, build;
+		bench(scan, 1, {
+			for (int j = 0; j < SAMPLES; ++ j)
+				results[j] = PIF_paletteClosest(pal, samples[j]);
+		});
+
+		PIF_PaletteIndex *idx;
+		bench(build, 100, {
+			idx = PIF_paletteIndexNew(pal);
+			PIF_paletteIndexFree(idx);
+		});
+
+		idx = PIF_paletteIndexNew(pal);
+		bench(index, 1, {
+			for (int j = 0; j < SAMPLES; ++ j) {
+				if (PIF_paletteIndexClosest(idx, samples[j]) != results[j])
+					die("Index result differs from the scan for palette \"%s\"", palettes[i]);
+			}
+		});
+		PIF_paletteIndexFree(idx);
+
+		printf("%-16s %12.2f %12.2f %12.4f %8.1fx\n", palettes[i], scan, index, build, scan / index);
+		PIF_paletteFree(pal);
+	}
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include "bench.inc"
+
+/* The colormap generation from before it was threaded and index accelerated */
+PIF_Image *createColormapReference(PIF_Palette *pal, int shades, float t) {
+	PIF_Image *colormap = PIF_imageNew(pal->size, pal->size + shades);
+	for (int x = 0; x < pal->size; ++ x) {
+		for (int y = 0; y < shades; ++ y) {
+			uint8_t color;
+			if (x == PIF_TRANSPARENT)
+				color = PIF_TRANSPARENT;
+			else {
+				float darken = (float)(shades - y) / (float)(shades / 2);
+
+				int r = (int)pal->map[x].r * darken;
+				int g = (int)pal->map[x].g * darken;
+				int b = (int)pal->map[x].b * darken;
+
+				PIF_Rgb rgb;
+				rgb.r = r > 255? 255 : r;
+				rgb.g = g > 255? 255 : g;
+				rgb.b = b > 255? 255 : b;
+				color = PIF_paletteClosest(pal, rgb);
+			}
+
+			*PIF_imageAt(colormap, x, y) = color;
+		}
+	}
+
+	for (int y = 0; y < pal->size; ++ y) {
+		for (int x = 0; x < pal->size; ++ x) {
+			uint8_t color;
+			if (x == PIF_TRANSPARENT || y == PIF_TRANSPARENT)
+				color = PIF_TRANSPARENT;
+			else
+				color = PIF_paletteClosest(pal, PIF_rgbLerp(pal->map[x], pal->map[y], t));
+
+			*PIF_imageAt(colormap, x, y + shades) = color;
+		}
+	}
+	return colormap;
+}
+
+int main(void) {
+	printf("%d threads\n", PIF_THREADS);
+	printf("%-16s %14s %14s %9s %10s\n", "palette", "reference (ms)", "colormap (ms)", "speedup",
+	       "lazy (ms)");
+	for (int i = 0; i < arraySize(palettes); ++ i) {
+		PIF_Palette *pal = loadPalette(palettes[i]);
+
+		PIF_Image *ref, *colormap, *lazy;
+		double     refTime, time, lazyTime;
+		bench(refTime, 1, {
+			ref = createColormapReference(pal, PIF_DEFAULT_SHADES, 0.5);
+		});
+
+		bench(time, 1, {
+			colormap = PIF_paletteCreateColormap(pal, PIF_DEFAULT_SHADES, 0.5);
+		});
+
+		bench(lazyTime, 1, {
+			lazy = PIF_paletteCreateLazyColormap(pal, PIF_DEFAULT_SHADES, 0.5);
+		});
+
+		if (memcmp(ref->buf, colormap->buf, ref->size) != 0)
+			die("Colormap differs from the reference for palette \"%s\"", palettes[i]);
+
+		/* A full shade reads the first blend row, which the lazy colormap has not generated */
+		for (int j = 0; j < pal->size; ++ j) {
+			if (PIF_shadeColor(j, 1, lazy) != PIF_shadeColor(j, 1, ref))
+				die("Lazy colormap full shade differs for palette \"%s\"", palettes[i]);
+		}
+
+		PIF_colormapBuild(lazy);
+		if (memcmp(ref->buf, lazy->buf, ref->size) != 0)
+			die("Lazy colormap differs from the reference for palette \"%s\"", palettes[i]);
+
+		printf("%-16s %14.2f %14.2f %8.1fx %10.2f\n", palettes[i], refTime, time, refTime / time,
+		       lazyTime);
+		PIF_imagesFree(ref, colormap, lazy);
+		PIF_paletteFree(pal);
+	}
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "bench.inc"
+
+#define IMAGE_W 8192
+#define IMAGE_H 8192
+#define LOADS   10
+#define PATH    "imagemap." PIF_IMAGE_EXT
+
+/* Sums a byte of every row, so the mapped image pays for its page faults */
+int touch(PIF_Image *img) {
+	int sum = 0;
+	for (int y = 0; y < img->h; ++ y)
+		sum += *PIF_imageAt(img, y % img->w, y);
+
+	return sum;
+}
+
+int main(void) {
+	(void)palettes;
+
+	PIF_Image *img = PIF_imageNew(IMAGE_W, IMAGE_H);
+	for (int i = 0; i < img->size; ++ i)
+		img->buf[i] = i * 7 % PIF_COLORS;
+
+	if (PIF_imageSave(img, PATH) != 0)
+		die("Failed to save \"%s\"", PATH);
+
+	int         expected = touch(img);
+	const char *err;
+	PIF_imageFree(img);
+
+	double load, map, populated;
+	bench(load, LOADS, {
+		img = PIF_imageLoad(PATH, &err);
+		if (img == NULL)
+			die("Error while loading \"%s\": %s", PATH, err);
+
+		if (touch(img) != expected)
+			die("Loaded image differs");
+
+		PIF_imageFree(img);
+	});
+
+	bench(map, LOADS, {
+		img = PIF_imageMap(PATH, false, &err);
+		if (img == NULL)
+			die("Error while mapping \"%s\": %s", PATH, err);
+
+		if (touch(img) != expected)
+			die("Mapped image differs");
+
+		PIF_imageFree(img);
+	});
+
+	bench(populated, LOADS, {
+		img = PIF_imageMap(PATH, true, &err);
+		if (img == NULL)
+			die("Error while mapping \"%s\": %s", PATH, err);
+
+		if (touch(img) != expected)
+			die("Mapped image differs");
+
+		PIF_imageFree(img);
+	});
+
+	remove(PATH);
+
+	printf("%dx%d image, cached file\n", IMAGE_W, IMAGE_H);
+	printf("%-16s %12s\n", "method", "time (ms)");
+	printf("%-16s %12.3f\n", "read",         load);
+	printf("%-16s %12.3f\n", "map",          map);
+	printf("%-16s %12.3f\n", "map populate", populated);
+	return 0;
+}
@@ -0,0 +1,49 @@
+#include "bench.inc"
+
+#define FRAME_W 1920
+#define FRAME_H 1080
+#define FRAMES  100
+
+static uint32_t pixels[FRAME_W * FRAME_H], outputPixels[FRAME_W * FRAME_H];
+
+static const char *formats[] = {"RGBA8888", "ABGR8888", "ARGB8888", "RGB565"};
+
+int main(void) {
+	PIF_Palette *pal  = loadPalette(palettes[0]);
+	PIF_Image   *canv = PIF_imageNew(FRAME_W, FRAME_H);
+
+	srand(0);
+	for (int i = 0; i < canv->size; ++ i)
+		canv->buf[i] = rand() % pal->size;
+
+	/* The per pixel conversion the SDL2 demos used before */
+	double loop;
+	bench(loop, FRAMES, {
+		for (int i = 0; i < canv->size; ++ i) {
+			uint8_t color = canv->buf[i];
+			pixels[i] = color == PIF_TRANSPARENT? 0 : PIF_rgbToPixelRgba32(pal->map[color]);
+		}
+	});
+
+	printf("%dx%d frame\n", FRAME_W, FRAME_H);
+	printf("%-16s %12s\n", "format", "time (ms)");
+	printf("%-16s %12.3f\n", "per pixel", loop);
+	for (int i = 0; i < arraySize(formats); ++ i) {
+		PIF_Output *output = PIF_outputNew(pal, i);
+
+		double time;
+		bench(time, FRAMES, {
+			PIF_outputConvert(output, canv, NULL, outputPixels, FRAME_W * output->bytes);
+		});
+
+		if (i == PIF_OUTPUT_RGBA8888 && memcmp(pixels, outputPixels, sizeof(pixels)) != 0)
+			die("Output differs from the per pixel conversion");
+
+		printf("%-16s %12.3f\n", formats[i], time);
+		PIF_outputFree(output);
+	}
+
+	PIF_imageFree(canv);
+	PIF_paletteFree(pal);
+	return 0;
+}
@@ -0,0 +1,71 @@
+#include "bench.inc"
+
+#define SIZE    32
+#define SAMPLES 1000000
+
+static PIF_Rgb samples[SAMPLES];
+static uint8_t results[SAMPLES], bufferResults[SAMPLES];
+
+/* The rgbmap generation from before it was threaded and split into blocks */
+PIF_Image *createRgbmapReference(PIF_Palette *pal, uint8_t size) {
+	PIF_Image *rgbmap = PIF_imageNew(size, (int)size * size);
+	for (int r = 0; r < size; ++ r) {
+		for (int g = 0; g < size; ++ g) {
+			for (int b = 0; b < size; ++ b) {
+				PIF_Rgb rgb;
+				rgb.r = (float)r / (size - 1) * 255;
+				rgb.g = (float)g / (size - 1) * 255;
+				rgb.b = (float)b / (size - 1) * 255;
+				*PIF_imageAt(rgbmap, r, g + b * size) = PIF_paletteClosest(pal, rgb);
+			}
+		}
+	}
+	return rgbmap;
+}
+
+int main(void) {
+	srand(0);
+	for (int i = 0; i < SAMPLES; ++ i) {
+		samples[i].r = rand() % 256;
+		samples[i].g = rand() % 256;
+		samples[i].b = rand() % 256;
+	}
+
+	printf("%d threads, rgbmap size %d, %d conversions\n", PIF_THREADS, SIZE, SAMPLES);
+	printf("%-16s %14s %12s %13s %13s\n", "palette", "reference (ms)", "rgbmap (ms)",
+	       "convert (ms)", "buffer (ms)");
+	for (int i = 0; i < arraySize(palettes); ++ i) {
+		PIF_Palette *pal = loadPalette(palettes[i]);
+
+		PIF_Image *ref, *rgbmap;
+		double     refTime, time, convertTime, bufferTime;
+		bench(refTime, 1, {
+			ref = createRgbmapReference(pal, SIZE);
+		});
+
+		bench(time, 1, {
+			rgbmap = PIF_paletteCreateRgbmap(pal, SIZE);
+		});
+
+		if (memcmp(ref->buf, rgbmap->buf, ref->size) != 0)
+			die("Rgbmap differs from the reference for palette \"%s\"", palettes[i]);
+
+		bench(convertTime, 1, {
+			for (int j = 0; j < SAMPLES; ++ j)
+				results[j] = PIF_rgbToColor(samples[j], rgbmap);
+		});
+
+		bench(bufferTime, 1, {
+			PIF_rgbToColorBuffer(samples, bufferResults, SAMPLES, rgbmap);
+		});
+
+		if (memcmp(results, bufferResults, SAMPLES) != 0)
+			die("Buffer conversion differs for palette \"%s\"", palettes[i]);
+
+		printf("%-16s %14.2f %12.2f %13.2f %13.2f\n", palettes[i], refTime, time,
+		       convertTime, bufferTime);
+		PIF_imagesFree(ref, rgbmap);
+		PIF_paletteFree(pal);
+	}
+	return 0;
+}
@@ -0,0 +1,72 @@
+#include "bench.inc"
+
+#define CANV_W  320
+#define CANV_H  200
+#define SPRITE  64
+#define BLITS   2000
+#define ROUNDS  20
+
+/* Percent of transparent pixels in the sprites */
+static const int transparent[] = {0, 25, 50, 75, 90};
+
+/* A disc of opaque pixels with a radius picked for the transparency ratio, like a typical sprite */
+PIF_Image *makeSprite(int percent) {
+	PIF_Image *img    = PIF_imageNew(SPRITE, SPRITE);
+	double     radius = sqrt((100 - percent) / 100.0 * SPRITE * SPRITE / M_PI);
+	for (int y = 0; y < SPRITE; ++ y) {
+		for (int x = 0; x < SPRITE; ++ x) {
+			double dx = x + 0.5 - SPRITE / 2, dy = y + 0.5 - SPRITE / 2;
+			if (percent == 0 || dx * dx + dy * dy < radius * radius)
+				*PIF_imageAt(img, x, y) = 1 + rand() % 255;
+		}
+	}
+	return img;
+}
+
+int main(void) {
+	(void)palettes;
+
+	PIF_Image *canv = PIF_imageNew(CANV_W, CANV_H);
+	PIF_Image *copy = PIF_imageNew(CANV_W, CANV_H);
+
+	/* Random positions, including ones partially off the canvas */
+	static int xs[BLITS], ys[BLITS];
+	for (int i = 0; i < BLITS; ++ i) {
+		xs[i] = rand() % (CANV_W + SPRITE) - SPRITE / 2;
+		ys[i] = rand() % (CANV_H + SPRITE) - SPRITE / 2;
+	}
+
+	printf("%dx%d sprites, %d blits\n", SPRITE, SPRITE, BLITS);
+	printf("%-12s %11s %11s %10s %11s %8s\n",
+	       "transparent", "image (B)", "sprite (B)", "blit (ms)", "sprite (ms)", "speedup");
+	for (int i = 0; i < arraySize(transparent); ++ i) {
+		PIF_Image  *img    = makeSprite(transparent[i]);
+		PIF_Sprite *sprite = PIF_spriteNew(img, NULL);
+
+		double blit, spriteBlit;
+		bench(blit, ROUNDS, {
+			for (int j = 0; j < BLITS; ++ j) {
+				PIF_Rect rect = {xs[j], ys[j], SPRITE, SPRITE};
+				PIF_imageBlit(copy, &rect, img, NULL);
+			}
+		});
+
+		bench(spriteBlit, ROUNDS, {
+			for (int j = 0; j < BLITS; ++ j)
+				PIF_imageBlitSprite(canv, sprite, xs[j], ys[j]);
+		});
+
+		if (memcmp(canv->buf, copy->buf, canv->size) != 0)
+			die("Sprite blit differs from the image blit at %d%% transparency", transparent[i]);
+
+		size_t size = sizeof(uint32_t) * (sprite->h + 1) + sprite->rows[sprite->h];
+		printf("%10d%% %11d %11zu %10.3f %11.3f %7.1fx\n", transparent[i], img->size, size,
+		       blit, spriteBlit, blit / spriteBlit);
+
+		PIF_spriteFree(sprite);
+		PIF_imageFree(img);
+	}
+
+	PIF_imagesFree(canv, copy);
+	return 0;
+}
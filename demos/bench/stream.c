@@ -0,0 +1,69 @@
+#include "bench.inc"
+
+#define IMAGE_W  8192
+#define IMAGE_H  8192
+#define BAND_H   256
+#define SRC_PATH "/tmp/pif_bench_stream.pif"
+#define OUT_PATH "/tmp/pif_bench_stream_out.pif"
+
+int main(void) {
+	PIF_Palette *from  = loadPalette(palettes[0]);
+	PIF_Palette *to    = loadPalette(palettes[3]);
+	PIF_Remap   *remap = PIF_remapNew(from, to);
+
+	/* Write the source image band by band, so it never has to be in memory as a whole */
+	const char      *err;
+	PIF_ImageStream *out = PIF_imageStreamCreate(SRC_PATH, IMAGE_W, from, &err);
+	if (out == NULL)
+		die("Error while creating \"%s\": %s", SRC_PATH, err);
+
+	PIF_Image *band = PIF_imageNew(IMAGE_W, BAND_H);
+	for (int y = 0; y < IMAGE_H; y += BAND_H) {
+		for (int i = 0; i < band->size; ++ i)
+			band->buf[i] = rand() % from->size;
+
+		PIF_imageStreamWriteBand(out, band->buf, band->pitch, BAND_H);
+	}
+	if (PIF_imageStreamClose(out) != 0)
+		die("Failed to finish \"%s\"", SRC_PATH);
+
+	double whole;
+	bench(whole, 1, {
+		PIF_Image *img = PIF_imageLoad(SRC_PATH, &err);
+		if (img == NULL)
+			die("Error while loading \"%s\": %s", SRC_PATH, err);
+
+		PIF_imageRemap(img, remap);
+		PIF_imageSave(img, OUT_PATH);
+		PIF_imageFree(img);
+	});
+
+	double banded;
+	bench(banded, 1, {
+		PIF_ImageStream *in = PIF_imageStreamOpen(SRC_PATH, &err);
+		if (in == NULL)
+			die("Error while opening \"%s\": %s", SRC_PATH, err);
+
+		out = PIF_imageStreamCreate(OUT_PATH, IMAGE_W, to, &err);
+		if (out == NULL)
+			die("Error while creating \"%s\": %s", OUT_PATH, err);
+
+		if (PIF_imageStreamRemap(in, out, BAND_H, remap, &err) != 0)
+			die("Error while remapping \"%s\": %s", SRC_PATH, err);
+
+		PIF_imageStreamClose(in);
+		PIF_imageStreamClose(out);
+	});
+
+	printf("Remapping a %dx%d image file\n", IMAGE_W, IMAGE_H);
+	printf("%-8s %12s %10s\n", "", "memory (MB)", "time (ms)");
+	printf("%-8s %12.1f %10.1f\n", "whole",  (double)IMAGE_W * IMAGE_H / (1 << 20), whole);
+	printf("%-8s %12.1f %10.1f\n", "banded", (double)IMAGE_W * BAND_H  / (1 << 20), banded);
+
+	remove(SRC_PATH);
+	remove(OUT_PATH);
+	PIF_imageFree(band);
+	PIF_remapFree(remap);
+	PIF_palettesFree(from, to);
+	return 0;
+}
@@ -0,0 +1,62 @@
+#include "bench.inc"
+
+#define FRAME_W 1920
+#define FRAME_H 1080
+#define FRAMES  100
+
+static uint32_t small[FRAME_W * FRAME_H], pixels[FRAME_W * FRAME_H], fusedPixels[FRAME_W * FRAME_H];
+
+static const int scales[] = {2, 3, 4, 6, 8};
+
+/* The separate scaling pass of the two pass presentation */
+void upscale(uint32_t *dest, const uint32_t *src, int w, int h, int scale) {
+	for (int y = 0; y < h; ++ y) {
+		uint32_t *row = dest + (size_t)y * scale * w * scale;
+		for (int x = 0; x < w; ++ x) {
+			for (int i = 0; i < scale; ++ i)
+				row[x * scale + i] = src[y * w + x];
+		}
+
+		for (int i = 1; i < scale; ++ i)
+			memcpy(row + (size_t)i * w * scale, row, w * scale * sizeof(*row));
+	}
+}
+
+int main(void) {
+	PIF_Palette *pal    = loadPalette(palettes[0]);
+	PIF_Output  *output = PIF_outputNew(pal, PIF_OUTPUT_RGBA8888);
+
+	printf("%dx%d frame\n", FRAME_W, FRAME_H);
+	printf("%-8s %14s %15s %10s %9s\n", "scale", "canvas", "two pass (ms)", "fused (ms)", "speedup");
+	for (int i = 0; i < arraySize(scales); ++ i) {
+		int        scale = scales[i];
+		PIF_Image *canv  = PIF_imageNew(FRAME_W / scale, FRAME_H / scale);
+
+		srand(0);
+		for (int j = 0; j < canv->size; ++ j)
+			canv->buf[j] = rand() % pal->size;
+
+		int    pitch = canv->w * scale * sizeof(uint32_t);
+		double twoPass, fused;
+		bench(twoPass, FRAMES, {
+			PIF_outputConvert(output, canv, NULL, small, canv->w * sizeof(uint32_t));
+			upscale(pixels, small, canv->w, canv->h, scale);
+		});
+
+		bench(fused, FRAMES, {
+			PIF_outputConvertScaled(output, canv, NULL, scale, fusedPixels, pitch);
+		});
+
+		if (memcmp(pixels, fusedPixels, (size_t)canv->h * scale * pitch) != 0)
+			die("Fused output differs from the two pass output at scale %d", scale);
+
+		char size[32];
+		snprintf(size, sizeof(size), "%dx%d", canv->w, canv->h);
+		printf("%-8d %14s %15.3f %10.3f %8.1fx\n", scale, size, twoPass, fused, twoPass / fused);
+		PIF_imageFree(canv);
+	}
+
+	PIF_outputFree(output);
+	PIF_paletteFree(pal);
+	return 0;
+}
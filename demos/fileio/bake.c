@@ -0,0 +1,69 @@
+#include <ctype.h> /* toupper */
+
+#include "../shared.inc"
+
+/* Bakes the colormap and rgbmap of a palette into a header of static const arrays, so programs
+   using the palette do not have to generate the tables at runtime */
+
+void usage(const char *app) {
+	die("Usage: %s PALETTE NAME [SHADES] [T] [RGBMAP SIZE] > OUTPUT.h\n"
+	    "An rgbmap size of 0 skips the rgbmap", app);
+}
+
+void writeTable(const char *name, const char *table, PIF_Image *img) {
+	printf("static const uint8_t %s%s[%i * %i] = {", name, table, img->w, img->h);
+	for (int i = 0; i < img->size; ++ i)
+		printf("%s0x%02X,", i % 16 == 0? "\n\t" : " ", img->buf[i]);
+
+	printf("\n};\n\n");
+	printf("static inline PIF_Image *%s%sNew(void) {\n", name, table);
+	printf("\treturn PIF_imageView(%i, %i, %s%s);\n", img->w, img->h, name, table);
+	printf("}\n\n");
+}
+
+int main(int argc, const char **argv) {
+	if (argc < 3 || argc > 6)
+		usage(argv[0]);
+
+	const char *path = argv[1], *name = argv[2];
+	int         shades     = argc > 3? atoi(argv[3]) : PIF_DEFAULT_SHADES;
+	float       t          = argc > 4? atof(argv[4]) : 0.5;
+	int         rgbmapSize = argc > 5? atoi(argv[5]) : 32;
+	if (shades < 0 || rgbmapSize < 0 || rgbmapSize > 255)
+		usage(argv[0]);
+
+	const char  *err;
+	PIF_Palette *pal = PIF_paletteLoad(path, &err);
+	if (pal == NULL)
+		die("Error while loading palette \"%s\": %s", path, err);
+
+	char guard[256];
+	int  i = 0;
+	for (; name[i] != '\0' && i < (int)sizeof(guard) - 1; ++ i)
+		guard[i] = toupper(name[i]);
+
+	guard[i] = '\0';
+
+	printf("/* Generated by bake from %s, do not edit */\n", path);
+	printf("#ifndef %s_TABLES_H_HEADER_GUARD\n", guard);
+	printf("#define %s_TABLES_H_HEADER_GUARD\n\n", guard);
+	printf("/* Compare with PIF_paletteHash to make sure the tables belong to the palette in use */\n");
+	printf("#define %s_PALETTE_HASH 0x%08Xu\n\n", guard, (unsigned)PIF_paletteHash(pal));
+
+	PIF_Image *colormap = PIF_paletteCreateColormap(pal, shades, t);
+	printf("#define %s_COLORMAP_SHADES %i\n", guard, shades);
+	printf("#define %s_COLORMAP_T      %.9ef\n\n", guard, t);
+	writeTable(name, "Colormap", colormap);
+	PIF_imageFree(colormap);
+
+	if (rgbmapSize > 0) {
+		PIF_Image *rgbmap = PIF_paletteCreateRgbmap(pal, rgbmapSize);
+		printf("#define %s_RGBMAP_SIZE %i\n\n", guard, rgbmapSize);
+		writeTable(name, "Rgbmap", rgbmap);
+		PIF_imageFree(rgbmap);
+	}
+
+	printf("#endif\n");
+	PIF_paletteFree(pal);
+	return 0;
+}
@@ -1,11 +1,31 @@
 #include "pif.h"
 
+#if !defined(PIF_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define PIF_X86_SIMD
+#	include <immintrin.h> /* SSE2 and AVX2 intrinsics */
+#endif
+
+#if PIF_THREADS > 1
+#	include <pthread.h> /* pthread_t, pthread_create, pthread_join */
+#endif
+
+#if !defined(PIF_NO_MMAP) && !defined(_WIN32)
+#	define PIF_MMAP
+#	include <sys/mman.h> /* mmap, munmap, MAP_FAILED */
+#	include <sys/stat.h> /* fstat, struct stat */
+#	include <fcntl.h>    /* open, O_RDONLY */
+#	include <unistd.h>   /* close */
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define PIF_error(ERR, MSG) ((ERR) != NULL? (*(ERR) = MSG, NULL) : NULL)
 
+/* Maximum amount of pixels gathered into a temporary row before being drawn as spans */
+#define PIF_SPAN_MAX 256
+
 #define PIF_checkAlloc(PTR)                                                         \
 	do {                                                                            \
 		if (PTR == NULL) {                                                          \
@@ -14,40 +34,16 @@ extern "C" {
 		}                                                                           \
 	} while (0)
 
-static void PIF_invertMatrix2x2(float input[2][2], float output[2][2]) {
-	float n, mat[2][2] = {
-		{input[0][0], input[0][1]},
-		{input[1][0], input[1][1]},
-	};
-
-	output[0][0] = 1;
-	output[1][0] = 0;
-	output[0][1] = 0;
-	output[1][1] = 1;
-
-	n = mat[0][0];
-	for (int x = 0; x < 2; ++ x) {
-		output[0][x] /= n;
-		mat[0][x]    /= n;
-	}
-
-	n = mat[1][0];
-	for (int x = 0; x < 2; ++ x) {
-		output[1][x] -= output[0][x] * n;
-		mat[1][x]    -= mat[0][x]    * n;
-	}
-
-	n = mat[1][1];
-	for (int x = 0; x < 2; ++ x) {
-		output[1][x] /= n;
-		/*mat[1][x]    /= n;*/
-	}
+static bool PIF_invertMatrix2x2(float input[2][2], float output[2][2]) {
+	float det = input[0][0] * input[1][1] - input[0][1] * input[1][0];
+	if (det == 0)
+		return false;
 
-	n = mat[0][1];
-	for (int x = 0; x < 2; ++ x) {
-		output[0][x] -= output[1][x] * n;
-		/*mat[0][x]    -= mat[1][x]    * n;*/
-	}
+	output[0][0] =  input[1][1] / det;
+	output[0][1] = -input[0][1] / det;
+	output[1][0] = -input[1][0] / det;
+	output[1][1] =  input[0][0] / det;
+	return true;
 }
 
 static void PIF_applyTransformMatrix2x2(int *x, int *y, float mat[2][2]) {
@@ -86,17 +82,12 @@ static void PIF_makeRotationMatrix2x2(float angle, float mat[2][2]) {
 	mat[1][1] =  angleCos;
 }
 
-static uint16_t PIF_bytesToU16(uint8_t *input) {
+static uint16_t PIF_bytesToU16(const uint8_t *input) {
 	return ((uint16_t)input[0]) |
 	       ((uint16_t)input[1] << 8);
 }
 
-static void PIF_u16ToBytes(uint16_t input, uint8_t *output) {
-	output[0] =  input & 0x00FF;
-	output[1] = (input & 0xFF00) >> 8;
-}
-
-static uint32_t PIF_bytesToU32(uint8_t *input) {
+static uint32_t PIF_bytesToU32(const uint8_t *input) {
 	return ((uint32_t)input[0])       |
 	       ((uint32_t)input[1] << 8)  |
 	       ((uint32_t)input[2] << 16) |
@@ -110,25 +101,208 @@ static void PIF_u32ToBytes(uint32_t input, uint8_t *output) {
 	output[3] = (input & 0xFF000000) >> 24;
 }
 
-static int PIF_read16(FILE *file, uint16_t *output) {
-	uint8_t bytes[2];
-	if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes))
-		return -1;
+/* Bounds checked reader of a byte buffer. The file readers read the fixed size parts of a file
+   into a buffer and parse them with the same functions as the memory readers */
+typedef struct {
+	const uint8_t *data;
+	size_t         size, pos;
+} PIF_Cursor;
+
+static PIF_Cursor PIF_cursorNew(const void *data, size_t size) {
+	PIF_Cursor cursor;
+	cursor.data = (const uint8_t*)data;
+	cursor.size = size;
+	cursor.pos  = 0;
+	return cursor;
+}
 
-	*output = PIF_bytesToU16(bytes);
-	return 0;
+/* Returns the next size bytes and moves past them, or NULL if there are not enough left */
+static const uint8_t *PIF_cursorTake(PIF_Cursor *self, size_t size) {
+	if (self->size - self->pos < size)
+		return NULL;
+
+	const uint8_t *bytes = self->data + self->pos;
+	self->pos += size;
+	return bytes;
 }
 
-static void PIF_write16(FILE *file, uint16_t input) {
-	uint8_t bytes[4];
-	PIF_u16ToBytes(input, bytes);
-	fwrite(bytes, 1, sizeof(bytes), file);
+/* Returns an error message if the magic bytes are missing or do not match */
+static const char *PIF_cursorMagic(PIF_Cursor *self, const char *magic, const char *mismatch) {
+	const uint8_t *bytes = PIF_cursorTake(self, strlen(magic));
+	if (bytes == NULL)
+		return "Failed to read magic bytes";
+
+	return strncmp((const char*)bytes, magic, strlen(magic)) == 0? NULL : mismatch;
+}
+
+/* CRC-32C (Castagnoli), which x86 computes with a single instruction for every 8 bytes */
+typedef uint32_t (*PIF_CrcKernel)(uint32_t, const uint8_t*, size_t);
+
+static uint32_t PIF_crcTable[256];
+
+static uint32_t PIF_crcScalar(uint32_t crc, const uint8_t *data, size_t size) {
+	for (size_t i = 0; i < size; ++ i)
+		crc = PIF_crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef PIF_X86_SIMD
+__attribute__((target("sse4.2")))
+static uint32_t PIF_crcSse42(uint32_t crc, const uint8_t *data, size_t size) {
+	size_t i = 0;
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t bytes;
+		memcpy(&bytes, data + i, sizeof(bytes));
+		crc64 = _mm_crc32_u64(crc64, bytes);
+	}
+	crc = (uint32_t)crc64;
+#endif
+
+	for (; i < size; ++ i)
+		crc = _mm_crc32_u8(crc, data[i]);
+
+	return crc;
+}
+#endif
+
+static PIF_CrcKernel PIF_crcKernel(void) {
+	static PIF_CrcKernel kernel = NULL;
+	if (kernel != NULL)
+		return kernel;
+
+#ifdef PIF_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		kernel = PIF_crcSse42;
+		return kernel;
+	}
+#endif
+
+	for (uint32_t i = 0; i < 256; ++ i) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; ++ j)
+			crc = crc & 1? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+
+		PIF_crcTable[i] = crc;
+	}
+
+	kernel = PIF_crcScalar;
+	return kernel;
+}
+
+/* Continues the CRC of the data before, which starts at 0 */
+static uint32_t PIF_crc(uint32_t crc, const void *data, size_t size) {
+	return ~PIF_crcKernel()(~crc, (const uint8_t*)data, size);
+}
+
+/* Maps a whole file read-only. If populate is set, the pages are read in up front instead of on
+   the first access. Without mmap support the file is read into memory instead */
+static void *PIF_mapFile(const char *path, size_t *size, bool populate) {
+#ifdef PIF_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (populate)
+		flags |= MAP_POPULATE;
+#endif
+
+	*size = st.st_size;
+	void *map = mmap(NULL, *size, PROT_READ, flags, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+#ifndef MAP_POPULATE
+	/* MAP_POPULATE is Linux only and hidden in strict standard modes, reading a byte of every page
+	   faults them in anywhere */
+	if (populate) {
+		volatile uint8_t touch;
+		for (size_t i = 0; i < *size; i += 4096)
+			touch = ((uint8_t*)map)[i];
+
+		(void)touch;
+	}
+#endif
+	return map;
+#else
+	(void)populate;
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	void *map = NULL;
+	long  len = fseek(file, 0, SEEK_END) == 0? ftell(file) : -1;
+	if (len > 0 && fseek(file, 0, SEEK_SET) == 0) {
+		map = PIF_alloc(len);
+		PIF_checkAlloc(map);
+
+		if (fread(map, 1, len, file) != (size_t)len) {
+			PIF_free(map);
+			map = NULL;
+		}
+	}
+
+	*size = len;
+	fclose(file);
+	return map;
+#endif
+}
+
+static void PIF_unmapFile(void *map, size_t size) {
+#ifdef PIF_MMAP
+	munmap(map, size);
+#else
+	(void)size;
+	PIF_free(map);
+#endif
+}
+
+/* Creates an image whose pixels are in a file mapping, the image unmaps it when freed */
+static PIF_Image *PIF_imageFromMap(void *map, size_t mapSize, uint8_t *buf, int w, int h) {
+	PIF_Image *self = PIF_imageView(w, h, buf);
+	self->map     = map;
+	self->mapSize = mapSize;
+	return self;
+}
+
+/* Writes the pixels of the image without the padding at the end of the rows */
+static void PIF_imageWriteBody(PIF_Image *self, FILE *file) {
+	if (self->pitch == self->w)
+		fwrite(self->buf, 1, self->size, file);
+	else {
+		for (int y = 0; y < self->h; ++ y)
+			fwrite(PIF_imageAt(self, 0, y), 1, self->w, file);
+	}
 }
 
 static float PIF_lerp(float a, float b, float f) {
     return a + f * (b - a); /* Fast lerp */
 }
 
+static uint8_t *PIF_lazyColormapRow(PIF_Image *colormap, int y);
+
+/* Row of the colormap for blending with the color to */
+static uint8_t *PIF_colormapBlendRow(PIF_Image *colormap, uint8_t to) {
+	int y = to + colormap->h - colormap->w;
+	if (colormap->lazy != NULL)
+		return PIF_lazyColormapRow(colormap, y);
+
+	return PIF_imageAt(colormap, 0, y);
+}
+
 PIF_DEF uint8_t PIF_shadeColor(uint8_t color, float shade, PIF_Image *colormap) {
 	PIF_assert(colormap->h > colormap->w);
 	PIF_assert(color       < colormap->w);
@@ -136,8 +310,12 @@ PIF_DEF uint8_t PIF_shadeColor(uint8_t color, float shade, PIF_Image *colormap)
 	if (shade > 1) shade = 1;
 	if (shade < 0) shade = 0;
 
-	int shades = colormap->h - colormap->w;
-	return *PIF_imageAt(colormap, color, shade * shades);
+	/* A full shade lands on the first blend row, which a lazy colormap may not have yet */
+	int shades = colormap->h - colormap->w, y = shade * shades;
+	if (y >= shades)
+		return PIF_colormapBlendRow(colormap, y - shades)[color];
+
+	return *PIF_imageAt(colormap, color, y);
 }
 
 PIF_DEF uint8_t PIF_blendColor(uint8_t from, uint8_t to, PIF_Image *colormap) {
@@ -148,8 +326,7 @@ PIF_DEF uint8_t PIF_blendColor(uint8_t from, uint8_t to, PIF_Image *colormap) {
 	if      (from == PIF_TRANSPARENT) return to;
 	else if (to   == PIF_TRANSPARENT) return from;
 
-	int shades = colormap->h - colormap->w;
-	return *PIF_imageAt(colormap, from, to + shades);
+	return PIF_colormapBlendRow(colormap, to)[from];
 }
 
 PIF_DEF int PIF_rgbDiff(PIF_Rgb a, PIF_Rgb b) {
@@ -167,13 +344,99 @@ PIF_DEF PIF_Rgb PIF_rgbLerp(PIF_Rgb a, PIF_Rgb b, float t) {
 	return rgb;
 }
 
+/* Cell of a channel value in an rgbmap of size n + 1. x * 32897 >> 23 equals x / 255 for every
+   x up to 255 * 254, so this is the same as truncating (float)value / 255 * n */
+#define PIF_rgbmapCell(VALUE, N) (((VALUE) * (N) * 32897) >> 23)
+
 PIF_DEF uint8_t PIF_rgbToColor(PIF_Rgb rgb, PIF_Image *rgbmap) {
 	PIF_assert(rgbmap->h == rgbmap->w * rgbmap->w);
 
-	rgb.r = (float)rgb.r / 255 * (rgbmap->w - 1);
-	rgb.g = (float)rgb.g / 255 * (rgbmap->w - 1);
-	rgb.b = (float)rgb.b / 255 * (rgbmap->w - 1);
-	return *PIF_imageAt(rgbmap, rgb.r, (int)rgb.g + (int)rgb.b * rgbmap->w);
+	int n = rgbmap->w - 1;
+	int r = PIF_rgbmapCell(rgb.r, n);
+	int g = PIF_rgbmapCell(rgb.g, n);
+	int b = PIF_rgbmapCell(rgb.b, n);
+	return rgbmap->buf[(b * rgbmap->w + g) * rgbmap->pitch + r];
+}
+
+/* Converts the first colors of the buffer and returns how many were converted */
+typedef int (*PIF_RgbToColorKernel)(const PIF_Rgb*, uint8_t*, int, PIF_Image*);
+
+static int PIF_rgbToColorScalar(const PIF_Rgb *rgbs, uint8_t *colors, int count, PIF_Image *rgbmap) {
+	for (int i = 0; i < count; ++ i)
+		colors[i] = PIF_rgbToColor(rgbs[i], rgbmap);
+
+	return count;
+}
+
+#ifdef PIF_X86_SIMD
+__attribute__((target("avx2")))
+static int PIF_rgbToColorAvx2(const PIF_Rgb *rgbs, uint8_t *colors, int count, PIF_Image *rgbmap) {
+	const uint8_t *bytes = (const uint8_t*)rgbs;
+
+	/* Move the 12 bytes of 4 colors into each lane, then each channel into its own 32-bit ints */
+	__m256i spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+	__m256i shufR  = _mm256_setr_epi8(0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9,  -1, -1, -1,
+	                                  0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9,  -1, -1, -1);
+	__m256i shufG  = _mm256_setr_epi8(1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1,
+	                                  1, -1, -1, -1, 4, -1, -1, -1, 7, -1, -1, -1, 10, -1, -1, -1);
+	__m256i shufB  = _mm256_setr_epi8(2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1,
+	                                  2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1);
+
+	__m256i n     = _mm256_set1_epi32(rgbmap->w - 1);
+	__m256i w     = _mm256_set1_epi32(rgbmap->w);
+	__m256i pitch = _mm256_set1_epi32(rgbmap->pitch);
+	__m256i scale = _mm256_set1_epi32(32897);
+
+	/* Each load reads 32 bytes, of which the 24 bytes of 8 colors are used */
+	int i = 0;
+	for (; (i + 8) * 3 + 8 <= count * 3; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(bytes + i * 3));
+		v = _mm256_permutevar8x32_epi32(v, spread);
+
+		__m256i r = _mm256_shuffle_epi8(v, shufR);
+		__m256i g = _mm256_shuffle_epi8(v, shufG);
+		__m256i b = _mm256_shuffle_epi8(v, shufB);
+		r = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_mullo_epi32(r, n), scale), 23);
+		g = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_mullo_epi32(g, n), scale), 23);
+		b = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_mullo_epi32(b, n), scale), 23);
+
+		__m256i at = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_add_epi32(_mm256_mullo_epi32(b, w), g), pitch), r);
+
+		int32_t ats[8];
+		_mm256_storeu_si256((__m256i*)ats, at);
+		for (int j = 0; j < 8; ++ j)
+			colors[i + j] = rgbmap->buf[ats[j]];
+	}
+	return i;
+}
+#endif
+
+/* Picks the fastest rgb to color conversion the CPU supports */
+static PIF_RgbToColorKernel PIF_rgbToColorKernel(void) {
+	static PIF_RgbToColorKernel kernel = NULL;
+	if (kernel != NULL)
+		return kernel;
+
+#ifdef PIF_X86_SIMD
+	__builtin_cpu_init();
+	if (sizeof(PIF_Rgb) == 3 && __builtin_cpu_supports("avx2"))
+		kernel = PIF_rgbToColorAvx2;
+	else
+#endif
+		kernel = PIF_rgbToColorScalar;
+
+	return kernel;
+}
+
+PIF_DEF void PIF_rgbToColorBuffer(const PIF_Rgb *rgbs, uint8_t *colors, int count,
+                                  PIF_Image *rgbmap) {
+	PIF_assert(rgbs   != NULL);
+	PIF_assert(colors != NULL);
+	PIF_assert(rgbmap->h == rgbmap->w * rgbmap->w);
+
+	/* The vector kernel leaves the last colors, which it can not load whole, to the scalar one */
+	int i = PIF_rgbToColorKernel()(rgbs, colors, count, rgbmap);
+	PIF_rgbToColorScalar(rgbs + i, colors + i, count - i, rgbmap);
 }
 
 PIF_DEF uint32_t PIF_rgbToPixelRgba32(PIF_Rgb self) {
@@ -231,33 +494,29 @@ PIF_DEF PIF_Palette *PIF_paletteNew(int size) {
 	return self;
 }
 
-PIF_DEF PIF_Palette *PIF_paletteRead(FILE *file, const char **err) {
-	PIF_assert(file != NULL);
-
-	/* Verify magic bytes */
-	char magic[sizeof(PIF_PALETTE_MAGIC) - 1];
-	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic))
-		return (PIF_Palette*)PIF_error(err, "Failed to read magic bytes");
+#define PIF_PALETTE_HEADER (sizeof(PIF_PALETTE_MAGIC) - 1 + 1)
 
-	if (strncmp(magic, PIF_PALETTE_MAGIC, sizeof(magic)) != 0)
-		return (PIF_Palette*)PIF_error(err, "File is not a PIF palette");
+/* Parses the magic bytes and the maximum color index */
+static const char *PIF_paletteParseHeader(PIF_Cursor *cursor, int *size) {
+	const char *msg = PIF_cursorMagic(cursor, PIF_PALETTE_MAGIC, "File is not a PIF palette");
+	if (msg != NULL)
+		return msg;
 
-	/* Read header */
-	int maxColor = fgetc(file);
-	if (maxColor == EOF)
-		return (PIF_Palette*)PIF_error(err, "Failed to read PIF palette maximum color index");
+	const uint8_t *maxColor = PIF_cursorTake(cursor, 1);
+	if (maxColor == NULL)
+		return "Failed to read PIF palette maximum color index";
 
-	PIF_Palette *self = PIF_paletteNew(maxColor + 1);
-	PIF_assert(self != NULL);
+	*size = *maxColor + 1;
+	return NULL;
+}
 
-	/* Read body */
-	for (int i = 0; i < self->size; ++ i) {
-		uint8_t bytes[3];
-		if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
-			PIF_paletteFree(self);
-			return (PIF_Palette*)PIF_error(err, "Failed to read PIF palette body");
-		}
+static PIF_Palette *PIF_paletteParseBody(PIF_Cursor *cursor, int size, const char **err) {
+	const uint8_t *bytes = PIF_cursorTake(cursor, size * 3);
+	if (bytes == NULL)
+		return (PIF_Palette*)PIF_error(err, "Failed to read PIF palette body");
 
+	PIF_Palette *self = PIF_paletteNew(size);
+	for (int i = 0; i < size; ++ i, bytes += 3) {
 		self->map[i].r = bytes[0];
 		self->map[i].g = bytes[1];
 		self->map[i].b = bytes[2];
@@ -265,6 +524,35 @@ PIF_DEF PIF_Palette *PIF_paletteRead(FILE *file, const char **err) {
 	return self;
 }
 
+PIF_DEF PIF_Palette *PIF_paletteRead(FILE *file, const char **err) {
+	PIF_assert(file != NULL);
+
+	uint8_t    header[PIF_PALETTE_HEADER];
+	PIF_Cursor cursor = PIF_cursorNew(header, fread(header, 1, sizeof(header), file));
+
+	int         size;
+	const char *msg = PIF_paletteParseHeader(&cursor, &size);
+	if (msg != NULL)
+		return (PIF_Palette*)PIF_error(err, msg);
+
+	uint8_t body[PIF_COLORS * 3];
+	cursor = PIF_cursorNew(body, fread(body, 1, size * 3, file));
+	return PIF_paletteParseBody(&cursor, size, err);
+}
+
+PIF_DEF PIF_Palette *PIF_paletteReadMem(const void *data, size_t size, const char **err) {
+	PIF_assert(data != NULL);
+
+	PIF_Cursor cursor = PIF_cursorNew(data, size);
+
+	int         colors;
+	const char *msg = PIF_paletteParseHeader(&cursor, &colors);
+	if (msg != NULL)
+		return (PIF_Palette*)PIF_error(err, msg);
+
+	return PIF_paletteParseBody(&cursor, colors, err);
+}
+
 PIF_DEF PIF_Palette *PIF_paletteLoad(const char *path, const char **err) {
 	PIF_assert(path != NULL);
 
@@ -337,325 +625,2550 @@ PIF_DEF uint8_t PIF_paletteClosest(PIF_Palette *self, PIF_Rgb rgb) {
 	return color;
 }
 
-PIF_DEF PIF_Image *PIF_paletteCreateColormap(PIF_Palette *self, int shades, float t) {
-	PIF_assert(self != NULL);
-
-	PIF_Image *colormap = PIF_imageNew(self->size, self->size + shades);
-	for (int x = 0; x < self->size; ++ x) {
-		for (int y = 0; y < shades; ++ y) {
-			uint8_t color;
-			if (x == PIF_TRANSPARENT)
-				color = PIF_TRANSPARENT;
-			else {
-				float darken = (float)(shades - y) / (float)(shades / 2);
-
-				int r = (int)self->map[x].r * darken;
-				int g = (int)self->map[x].g * darken;
-				int b = (int)self->map[x].b * darken;
-
-				if (r > 255) r = 255;
-				if (g > 255) g = 255;
-				if (b > 255) b = 255;
-
-				PIF_Rgb rgb;
-				rgb.r = r;
-				rgb.g = g;
-				rgb.b = b;
-				color = PIF_paletteClosest(self, rgb);
-			}
+/* Size of the SIMD blocks the palette index is padded to */
+#define PIF_INDEX_BLOCK 8
 
-			*PIF_imageAt(colormap, x, y) = color;
-		}
-	}
+/* Returns the position of the closest color in the index. Colors are stored in palette order, so
+   keeping the first of equal differences gives the same tie-breaking as PIF_paletteClosest */
+typedef int (*PIF_IndexSearch)(PIF_PaletteIndex*, PIF_Rgb);
 
-	for (int y = 0; y < self->size; ++ y) {
-		for (int x = 0; x < self->size; ++ x) {
-			uint8_t color;
-			if (x == PIF_TRANSPARENT || y == PIF_TRANSPARENT)
-				color = PIF_TRANSPARENT;
-			else
-				color = PIF_paletteClosest(self, PIF_rgbLerp(self->map[x], self->map[y], t));
+static int PIF_indexSearchScalar(PIF_PaletteIndex *self, PIF_Rgb rgb) {
+	int pos = 0, minDiff = INT_MAX;
+	for (int i = 0; i < self->size; ++ i) {
+		int dr = self->rg[i * 2]     - rgb.r;
+		int dg = self->rg[i * 2 + 1] - rgb.g;
+		int db = self->b0[i * 2]     - rgb.b;
 
-			*PIF_imageAt(colormap, x, y + shades) = color;
+		int diff = dr * dr + dg * dg + db * db;
+		if (diff < minDiff) {
+			minDiff = diff;
+			pos     = i;
 		}
 	}
-	return colormap;
+	return pos;
 }
 
-PIF_DEF PIF_Image *PIF_paletteCreateRgbmap(PIF_Palette *self, uint8_t size) {
-	PIF_assert(self != NULL);
-
-	PIF_Image *rgbmap = PIF_imageNew(size, (int)size * size);
-	for (int r = 0; r < size; ++ r) {
-		for (int g = 0; g < size; ++ g) {
-			for (int b = 0; b < size; ++ b) {
-				PIF_Rgb rgb;
-				rgb.r = (float)r / (size - 1) * 255;
-				rgb.g = (float)g / (size - 1) * 255;
-				rgb.b = (float)b / (size - 1) * 255;
-				*PIF_imageAt(rgbmap, r, g + b * size) = PIF_paletteClosest(self, rgb);
-			}
+/* Picks the best of the per-lane minimums, ties go to the lower position */
+static int PIF_indexReduce(const int32_t *diffs, const int32_t *poss, int lanes) {
+	int pos = poss[0], minDiff = diffs[0];
+	for (int i = 1; i < lanes; ++ i) {
+		if (diffs[i] < minDiff || (diffs[i] == minDiff && poss[i] < pos)) {
+			minDiff = diffs[i];
+			pos     = poss[i];
 		}
 	}
-	return rgbmap;
+	return pos;
 }
 
-PIF_DEF void PIF_blendShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
-	(void)x; (void)y;
-	PIF_Image *colormap = (PIF_Image*)img->data;
-	PIF_assert(colormap != NULL);
+#ifdef PIF_X86_SIMD
+__attribute__((target("sse2")))
+static int PIF_indexSearchSse2(PIF_PaletteIndex *self, PIF_Rgb rgb) {
+	__m128i rg   = _mm_set1_epi32(rgb.r | (rgb.g << 16));
+	__m128i b0   = _mm_set1_epi32(rgb.b);
+	__m128i best = _mm_set1_epi32(INT_MAX);
+	__m128i pos  = _mm_setzero_si128();
+	__m128i cur  = _mm_setr_epi32(0, 1, 2, 3);
+	__m128i step = _mm_set1_epi32(4);
+
+	for (int i = 0; i < self->size; i += 4) {
+		__m128i drg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(self->rg + i * 2)), rg);
+		__m128i db0 = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(self->b0 + i * 2)), b0);
+
+		/* dr * dr + dg * dg and db * db + 0 * 0 of 4 colors */
+		__m128i diff = _mm_add_epi32(_mm_madd_epi16(drg, drg), _mm_madd_epi16(db0, db0));
+		__m128i less = _mm_cmpgt_epi32(best, diff);
+
+		best = _mm_or_si128(_mm_and_si128(less, diff), _mm_andnot_si128(less, best));
+		pos  = _mm_or_si128(_mm_and_si128(less, cur),  _mm_andnot_si128(less, pos));
+		cur  = _mm_add_epi32(cur, step);
+	}
 
-	*pixel = PIF_blendColor(*pixel, color, colormap);
+	int32_t diffs[4], poss[4];
+	_mm_storeu_si128((__m128i*)diffs, best);
+	_mm_storeu_si128((__m128i*)poss,  pos);
+	return PIF_indexReduce(diffs, poss, 4);
 }
 
-PIF_DEF void PIF_ditherShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
-	(void)img;
+__attribute__((target("avx2")))
+static int PIF_indexSearchAvx2(PIF_PaletteIndex *self, PIF_Rgb rgb) {
+	__m256i rg   = _mm256_set1_epi32(rgb.r | (rgb.g << 16));
+	__m256i b0   = _mm256_set1_epi32(rgb.b);
+	__m256i best = _mm256_set1_epi32(INT_MAX);
+	__m256i pos  = _mm256_setzero_si256();
+	__m256i cur  = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i step = _mm256_set1_epi32(8);
+
+	for (int i = 0; i < self->size; i += 8) {
+		__m256i drg = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(self->rg + i * 2)), rg);
+		__m256i db0 = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(self->b0 + i * 2)), b0);
+
+		__m256i diff = _mm256_add_epi32(_mm256_madd_epi16(drg, drg), _mm256_madd_epi16(db0, db0));
+		__m256i less = _mm256_cmpgt_epi32(best, diff);
+
+		best = _mm256_blendv_epi8(best, diff, less);
+		pos  = _mm256_blendv_epi8(pos,  cur,  less);
+		cur  = _mm256_add_epi32(cur, step);
+	}
 
-	if (x % 2 == (y % 2 == 0))
-		*pixel = color;
+	int32_t diffs[8], poss[8];
+	_mm256_storeu_si256((__m256i*)diffs, best);
+	_mm256_storeu_si256((__m256i*)poss,  pos);
+	return PIF_indexReduce(diffs, poss, 8);
 }
+#endif
 
-PIF_DEF void PIF_copyShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
-	(void)color;
-	PIF_Image *src = (PIF_Image*)img->data;
-	PIF_assert(src != NULL);
+/* Picks the fastest index search the CPU supports */
+static PIF_IndexSearch PIF_indexSearchKernel(void) {
+	static PIF_IndexSearch kernel = NULL;
+	if (kernel != NULL)
+		return kernel;
+
+#ifdef PIF_X86_SIMD
+	__builtin_cpu_init();
+	if      (__builtin_cpu_supports("avx2")) kernel = PIF_indexSearchAvx2;
+	else if (__builtin_cpu_supports("sse2")) kernel = PIF_indexSearchSse2;
+	else
+#endif
+		kernel = PIF_indexSearchScalar;
 
-	*pixel = *PIF_imageAt(src, (float)x / img->w * src->w, (float)y / img->h * src->h);
+	return kernel;
 }
 
-PIF_DEF void PIF_exCopyShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
-	(void)color;
-	PIF_CopyInfo *info = (PIF_CopyInfo*)img->data;
-	PIF_assert(info != NULL);
+static int PIF_indexDiff(PIF_PaletteIndex *self, int pos, PIF_Rgb rgb) {
+	int dr = self->rg[pos * 2]     - rgb.r;
+	int dg = self->rg[pos * 2 + 1] - rgb.g;
+	int db = self->b0[pos * 2]     - rgb.b;
+	return dr * dr + dg * dg + db * db;
+}
 
-	int xSrc = x - (info->destRect.x + info->destRect.w / 2);
-	int ySrc = y - (info->destRect.y + info->destRect.h / 2);
-	if (info->transform) {
-		xSrc -= info->cx;
-		ySrc -= info->cy;
-		PIF_applyTransformMatrix2x2(&xSrc, &ySrc, info->mat);
-		xSrc += info->cx;
-		ySrc += info->cy;
+static void PIF_paletteIndexInit(PIF_PaletteIndex *self, PIF_Palette *palette) {
+	PIF_assert(palette != NULL);
+
+	/* Resolve the search kernel now, before any threads search the index */
+	PIF_indexSearchKernel();
+
+	self->size = 0;
+	for (int i = 0; i < palette->size; ++ i) {
+		if (i == PIF_TRANSPARENT)
+			continue;
+
+		int pos = self->size ++;
+		self->rg[pos * 2]     = palette->map[i].r;
+		self->rg[pos * 2 + 1] = palette->map[i].g;
+		self->b0[pos * 2]     = palette->map[i].b;
+		self->b0[pos * 2 + 1] = 0;
+		self->color[pos]      = i;
 	}
-	xSrc = (float)(xSrc + info->ox) / info->destRect.w * info->srcRect.w + info->srcRect.w / 2;
-	ySrc = (float)(ySrc + info->oy) / info->destRect.h * info->srcRect.h + info->srcRect.h / 2;
 
-	uint8_t *src = PIF_imageAt(info->src, xSrc + info->srcRect.x, ySrc + info->srcRect.y);
-	if (src != NULL)
-		*pixel = *src;
+	self->count = self->size;
+
+	/* Pad with copies of the last color, those can never win a tie against the original */
+	if (self->size == 0)
+		return;
+
+	int last = self->size - 1;
+	while (self->size % PIF_INDEX_BLOCK != 0) {
+		int pos = self->size ++;
+		self->rg[pos * 2]     = self->rg[last * 2];
+		self->rg[pos * 2 + 1] = self->rg[last * 2 + 1];
+		self->b0[pos * 2]     = self->b0[last * 2];
+		self->b0[pos * 2 + 1] = 0;
+		self->color[pos]      = self->color[last];
+	}
 }
 
-PIF_DEF PIF_Image *PIF_imageNew(int w, int h) {
-	int        cap  = sizeof(PIF_Image) + w * h - 1;
-	PIF_Image *self = (PIF_Image*)PIF_alloc(cap);
+PIF_DEF PIF_PaletteIndex *PIF_paletteIndexNew(PIF_Palette *palette) {
+	PIF_PaletteIndex *self = (PIF_PaletteIndex*)PIF_alloc(sizeof(PIF_PaletteIndex));
 	PIF_checkAlloc(self);
 
-	memset(self, 0, cap);
-	self->w    = w;
-	self->h    = h;
-	self->size = w * h;
-	self->skipTransparent = true;
+	PIF_paletteIndexInit(self, palette);
 	return self;
 }
 
-PIF_DEF PIF_Image *PIF_imageRead(FILE *file, const char **err) {
-	PIF_assert(file != NULL);
+PIF_DEF void PIF_paletteIndexFree(PIF_PaletteIndex *self) {
+	PIF_assert(self != NULL);
 
-	/* Verify magic bytes */
-	char magic[sizeof(PIF_IMAGE_MAGIC) - 1];
-	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic))
-		return (PIF_Image*)PIF_error(err, "Failed to read magic bytes");
+	PIF_free(self);
+}
 
-	if (strncmp(magic, PIF_IMAGE_MAGIC, sizeof(magic)) != 0)
-		return (PIF_Image*)PIF_error(err, "File is not a PIF image");
+/* Gives the same result as PIF_paletteClosest on the indexed palette */
+PIF_DEF uint8_t PIF_paletteIndexClosest(PIF_PaletteIndex *self, PIF_Rgb rgb) {
+	PIF_assert(self != NULL);
 
-	/* Read header */
-	uint16_t w, h;
-	if (PIF_read16(file, &w) != 0 || PIF_read16(file, &h) != 0)
-		return (PIF_Image*)PIF_error(err, "Failed to read PIF image size");
+	if (self->size == 0)
+		return 0;
 
-	PIF_Image *self = PIF_imageNew(w, h);
+	return self->color[PIF_indexSearchKernel()(self, rgb)];
+}
 
-	/* Read body */
-	if (fread(self->buf, 1, self->size, file) != (size_t)self->size) {
-		PIF_imageFree(self);
-		return (PIF_Image*)PIF_error(err, "Failed to read PIF image body");
-	}
+static void PIF_remapInit(PIF_Remap *self, PIF_Palette *from, PIF_Palette *to) {
+	PIF_assert(from != NULL);
+	PIF_assert(to   != NULL);
+
+	PIF_PaletteIndex index;
+	PIF_paletteIndexInit(&index, to);
+
+	/* Colors outside of the source palette are kept as they are */
+	for (int i = 0; i < PIF_COLORS; ++ i)
+		self->map[i] = i < from->size? PIF_paletteIndexClosest(&index, from->map[i]) : i;
+}
+
+PIF_DEF PIF_Remap *PIF_remapNew(PIF_Palette *from, PIF_Palette *to) {
+	PIF_Remap *self = (PIF_Remap*)PIF_alloc(sizeof(PIF_Remap));
+	PIF_checkAlloc(self);
+
+	PIF_remapInit(self, from, to);
 	return self;
 }
 
-PIF_DEF PIF_Image *PIF_imageLoad(const char *path, const char **err) {
-	PIF_assert(path != NULL);
+PIF_DEF void PIF_remapFree(PIF_Remap *self) {
+	PIF_assert(self != NULL);
 
-	FILE *file = fopen(path, "rb");
-	if (file == NULL)
-		return (PIF_Image*)PIF_error(err, "Could not open file");
+	PIF_free(self);
+}
 
-	PIF_Image *self = PIF_imageRead(file, err);
+PIF_DEF void PIF_remapApply(PIF_Remap *self, uint8_t *buf, int size) {
+	PIF_assert(self != NULL);
+	PIF_assert(buf  != NULL);
+
+	/* Unrolled so the independent table loads can overlap */
+	const uint8_t *map = self->map;
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint8_t a = map[buf[i]],     b = map[buf[i + 1]];
+		uint8_t c = map[buf[i + 2]], d = map[buf[i + 3]];
+		uint8_t e = map[buf[i + 4]], f = map[buf[i + 5]];
+		uint8_t g = map[buf[i + 6]], h = map[buf[i + 7]];
+		buf[i]     = a; buf[i + 1] = b;
+		buf[i + 2] = c; buf[i + 3] = d;
+		buf[i + 4] = e; buf[i + 5] = f;
+		buf[i + 6] = g; buf[i + 7] = h;
+	}
 
-	fclose(file);
+	for (; i < size; ++ i)
+		buf[i] = map[buf[i]];
+}
+
+static uint32_t PIF_outputPixel(PIF_Rgb rgb, int format) {
+	switch (format) {
+	case PIF_OUTPUT_RGBA8888:
+		return (uint32_t)rgb.r << 24 | (uint32_t)rgb.g << 16 | (uint32_t)rgb.b << 8 | 0xFF;
+	case PIF_OUTPUT_ABGR8888:
+		return 0xFF000000 | (uint32_t)rgb.b << 16 | (uint32_t)rgb.g << 8 | rgb.r;
+	case PIF_OUTPUT_ARGB8888:
+		return 0xFF000000 | (uint32_t)rgb.r << 16 | (uint32_t)rgb.g << 8 | rgb.b;
+	case PIF_OUTPUT_RGB565:
+		return (uint32_t)(rgb.r >> 3) << 11 | (uint32_t)(rgb.g >> 2) << 5 | rgb.b >> 3;
+
+	default: PIF_assert(0 && "Unknown output format");
+	}
+	return 0;
+}
+
+PIF_DEF PIF_Output *PIF_outputNew(PIF_Palette *pal, int format) {
+	PIF_assert(format >= PIF_OUTPUT_RGBA8888 && format <= PIF_OUTPUT_RGB565);
+
+	PIF_Output *self = (PIF_Output*)PIF_alloc(sizeof(PIF_Output));
+	PIF_checkAlloc(self);
+
+	self->format = format;
+	self->bytes  = format == PIF_OUTPUT_RGB565? 2 : 4;
+	PIF_outputUpdate(self, pal);
 	return self;
 }
 
-PIF_DEF void PIF_imageWrite(PIF_Image *self, FILE *file) {
+PIF_DEF void PIF_outputUpdate(PIF_Output *self, PIF_Palette *pal) {
 	PIF_assert(self != NULL);
-	PIF_assert(file != NULL);
+	PIF_assert(pal  != NULL);
 
-	/* Write magic bytes */
-	fwrite(PIF_IMAGE_MAGIC, 1, sizeof(PIF_IMAGE_MAGIC) - 1, file);
+	/* Colors outside of the palette are black, like the transparent color */
+	for (int i = 0; i < PIF_COLORS; ++ i)
+		self->lut[i] = i < pal->size && i != PIF_TRANSPARENT?
+		               PIF_outputPixel(pal->map[i], self->format) : 0;
+}
 
-	/* Write header */
-	PIF_assert(self->w <= USHRT_MAX && self->h <= USHRT_MAX);
-	PIF_write16(file, self->w);
-	PIF_write16(file, self->h);
+PIF_DEF void PIF_outputFree(PIF_Output *self) {
+	PIF_assert(self != NULL);
 
-	/* Write body */
-	fwrite(self->buf, 1, self->size, file);
+	PIF_free(self);
+}
+
+typedef void (*PIF_OutputRow)(void*, const uint8_t*, int, const uint32_t*);
+
+static void PIF_outputRow32Scalar(void *dest, const uint8_t *src, int len, const uint32_t *lut) {
+	uint32_t *out = (uint32_t*)dest;
+
+	int i = 0;
+	for (; i + 8 <= len; i += 8) {
+		out[i]     = lut[src[i]];     out[i + 1] = lut[src[i + 1]];
+		out[i + 2] = lut[src[i + 2]]; out[i + 3] = lut[src[i + 3]];
+		out[i + 4] = lut[src[i + 4]]; out[i + 5] = lut[src[i + 5]];
+		out[i + 6] = lut[src[i + 6]]; out[i + 7] = lut[src[i + 7]];
+	}
+
+	for (; i < len; ++ i)
+		out[i] = lut[src[i]];
+}
+
+static void PIF_outputRow16(void *dest, const uint8_t *src, int len, const uint32_t *lut) {
+	uint16_t *out = (uint16_t*)dest;
+
+	int i = 0;
+	for (; i + 8 <= len; i += 8) {
+		out[i]     = lut[src[i]];     out[i + 1] = lut[src[i + 1]];
+		out[i + 2] = lut[src[i + 2]]; out[i + 3] = lut[src[i + 3]];
+		out[i + 4] = lut[src[i + 4]]; out[i + 5] = lut[src[i + 5]];
+		out[i + 6] = lut[src[i + 6]]; out[i + 7] = lut[src[i + 7]];
+	}
+
+	for (; i < len; ++ i)
+		out[i] = lut[src[i]];
+}
+
+#ifdef PIF_X86_SIMD
+__attribute__((target("avx2")))
+static void PIF_outputRow32Avx2(void *dest, const uint8_t *src, int len, const uint32_t *lut) {
+	uint32_t *out = (uint32_t*)dest;
+
+	int i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i colors = _mm_loadu_si128((const __m128i*)(src + i));
+		__m256i lo     = _mm256_cvtepu8_epi32(colors);
+		__m256i hi     = _mm256_cvtepu8_epi32(_mm_srli_si128(colors, 8));
+
+		_mm256_storeu_si256((__m256i*)(out + i),     _mm256_i32gather_epi32((const int*)lut, lo, 4));
+		_mm256_storeu_si256((__m256i*)(out + i + 8), _mm256_i32gather_epi32((const int*)lut, hi, 4));
+	}
+
+	PIF_outputRow32Scalar(out + i, src + i, len - i, lut);
 }
 
-PIF_DEF int PIF_imageSave(PIF_Image *self, const char *path) {
-	PIF_assert(self != NULL);
-	PIF_assert(path != NULL);
+__attribute__((target("avx2")))
+static void PIF_outputRow16Avx2(void *dest, const uint8_t *src, int len, const uint32_t *lut) {
+	uint16_t *out = (uint16_t*)dest;
+
+	int i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i colors = _mm_loadu_si128((const __m128i*)(src + i));
+		__m256i lo     = _mm256_cvtepu8_epi32(colors);
+		__m256i hi     = _mm256_cvtepu8_epi32(_mm_srli_si128(colors, 8));
+
+		/* The packing works within 128-bit lanes, so the halves have to be put back in order */
+		__m256i pixels = _mm256_packus_epi32(_mm256_i32gather_epi32((const int*)lut, lo, 4),
+		                                     _mm256_i32gather_epi32((const int*)lut, hi, 4));
+		_mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(pixels, 0xD8));
+	}
+
+	PIF_outputRow16(out + i, src + i, len - i, lut);
+}
+#endif
+
+/* Picks the fastest row conversion the CPU supports for pixels of the given size */
+static PIF_OutputRow PIF_outputRowKernel(int bytes) {
+	static PIF_OutputRow kernels[2] = {NULL, NULL};
+	if (kernels[0] != NULL)
+		return kernels[bytes == 4];
+
+#ifdef PIF_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		kernels[1] = PIF_outputRow32Avx2;
+		kernels[0] = PIF_outputRow16Avx2;
+	} else
+#endif
+	{
+		kernels[1] = PIF_outputRow32Scalar;
+		kernels[0] = PIF_outputRow16;
+	}
+
+	return kernels[bytes == 4];
+}
+
+typedef void (*PIF_OutputScaledRow)(void*, const uint8_t*, int, int, const uint32_t*);
+
+static void PIF_outputScaledRow32Scalar(void *dest, const uint8_t *src, int len, int scale,
+                                        const uint32_t *lut) {
+	uint32_t *out = (uint32_t*)dest;
+	for (int i = 0; i < len; ++ i) {
+		uint32_t pixel = lut[src[i]];
+		for (int j = 0; j < scale; ++ j)
+			*out ++ = pixel;
+	}
+}
+
+static void PIF_outputScaledRow16(void *dest, const uint8_t *src, int len, int scale,
+                                  const uint32_t *lut) {
+	uint16_t *out = (uint16_t*)dest;
+	for (int i = 0; i < len; ++ i) {
+		uint16_t pixel = lut[src[i]];
+		for (int j = 0; j < scale; ++ j)
+			*out ++ = pixel;
+	}
+}
+
+#ifdef PIF_X86_SIMD
+__attribute__((target("avx2")))
+static void PIF_outputScaledRow32Avx2(void *dest, const uint8_t *src, int len, int scale,
+                                      const uint32_t *lut) {
+	/* Wide pixels are a run of whole vectors each, the scalar loop handles them fine */
+	if (scale > 8) {
+		PIF_outputScaledRow32Scalar(dest, src, len, scale, lut);
+		return;
+	}
+
+	/* Lane j of the output vector v repeats the gathered pixel (v * 8 + j) / scale */
+	__m256i spread[8];
+	for (int v = 0; v < scale; ++ v) {
+		int lanes[8];
+		for (int j = 0; j < 8; ++ j)
+			lanes[j] = (v * 8 + j) / scale;
+
+		spread[v] = _mm256_loadu_si256((const __m256i*)lanes);
+	}
+
+	uint32_t *out = (uint32_t*)dest;
+
+	int i = 0;
+	for (; i + 8 <= len; i += 8) {
+		__m256i colors = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + i)));
+		__m256i pixels = _mm256_i32gather_epi32((const int*)lut, colors, 4);
+
+		for (int v = 0; v < scale; ++ v, out += 8)
+			_mm256_storeu_si256((__m256i*)out, _mm256_permutevar8x32_epi32(pixels, spread[v]));
+	}
+
+	PIF_outputScaledRow32Scalar(out, src + i, len - i, scale, lut);
+}
+#endif
+
+static PIF_OutputScaledRow PIF_outputScaledRowKernel(int bytes) {
+	static PIF_OutputScaledRow kernel = NULL;
+	if (bytes == 2)
+		return PIF_outputScaledRow16;
+
+	if (kernel != NULL)
+		return kernel;
+
+#ifdef PIF_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) kernel = PIF_outputScaledRow32Avx2;
+	else
+#endif
+		kernel = PIF_outputScaledRow32Scalar;
+
+	return kernel;
+}
+
+PIF_DEF void PIF_outputConvert(PIF_Output *self, PIF_Image *img, PIF_Rect *rect,
+                               void *pixels, int pitch) {
+	PIF_outputConvertScaled(self, img, rect, 1, pixels, pitch);
+}
+
+PIF_DEF void PIF_outputConvertScaled(PIF_Output *self, PIF_Image *img, PIF_Rect *rect, int scale,
+                                     void *pixels, int pitch) {
+	PIF_assert(self   != NULL);
+	PIF_assert(img    != NULL);
+	PIF_assert(pixels != NULL);
+	PIF_assert(scale  >= 1);
+
+	PIF_Rect rect_ = {0, 0, img->w, img->h};
+	if (rect == NULL)
+		rect = &rect_;
+
+	PIF_assert(rect->x >= 0 && rect->x + rect->w <= img->w);
+	PIF_assert(rect->y >= 0 && rect->y + rect->h <= img->h);
+	PIF_assert(pitch >= rect->w * scale * self->bytes);
+
+	if (img->lazy != NULL)
+		PIF_colormapBuild(img);
+
+	uint8_t *dest = (uint8_t*)pixels;
+	if (scale == 1) {
+		PIF_OutputRow row = PIF_outputRowKernel(self->bytes);
+		for (int y = 0; y < rect->h; ++ y)
+			row(dest + (size_t)y * pitch, PIF_imageAt(img, rect->x, rect->y + y), rect->w, self->lut);
+
+		return;
+	}
+
+	/* Every canvas row is converted once, the copies of it are plain memory copies */
+	PIF_OutputScaledRow row = PIF_outputScaledRowKernel(self->bytes);
+	size_t rowSize = (size_t)rect->w * scale * self->bytes;
+	for (int y = 0; y < rect->h; ++ y) {
+		uint8_t *first = dest + (size_t)y * scale * pitch;
+		row(first, PIF_imageAt(img, rect->x, rect->y + y), rect->w, scale, self->lut);
+
+		for (int i = 1; i < scale; ++ i)
+			memcpy(first + (size_t)i * pitch, first, rowSize);
+	}
+}
+
+/* Calls job(data, from, to) on ranges of rows covering rows 0 to rows - 1, split between up to
+   PIF_THREADS threads. The calling thread works on the first range */
+typedef void (*PIF_RowJob)(void*, int, int);
+
+#if PIF_THREADS > 1
+typedef struct {
+	PIF_RowJob job;
+	void      *data;
+	int        from, to;
+} PIF_RowTask;
+
+static void *PIF_rowTaskRun(void *arg) {
+	PIF_RowTask *task = (PIF_RowTask*)arg;
+	task->job(task->data, task->from, task->to);
+	return NULL;
+}
+#endif
+
+static void PIF_parallelRows(int rows, PIF_RowJob job, void *data) {
+	if (rows <= 0)
+		return;
+
+#if PIF_THREADS > 1
+	int count = PIF_min(PIF_THREADS, rows);
+
+	PIF_RowTask tasks[PIF_THREADS];
+	pthread_t   threads[PIF_THREADS];
+	bool        started[PIF_THREADS];
+	for (int i = 1; i < count; ++ i) {
+		tasks[i].job  = job;
+		tasks[i].data = data;
+		tasks[i].from = (int64_t)rows * i       / count;
+		tasks[i].to   = (int64_t)rows * (i + 1) / count;
+
+		/* If a thread can not be created, its rows are done on this one */
+		started[i] = pthread_create(&threads[i], NULL, PIF_rowTaskRun, &tasks[i]) == 0;
+		if (!started[i])
+			job(data, tasks[i].from, tasks[i].to);
+	}
+
+	job(data, 0, rows / count);
+
+	for (int i = 1; i < count; ++ i) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+#else
+	job(data, 0, rows);
+#endif
+}
+
+typedef struct {
+	PIF_Palette      *pal;
+	PIF_PaletteIndex *index;
+	PIF_Image        *colormap;
+	int               shades;
+	float             t;
+} PIF_ColormapJob;
+
+/* The first shades rows darken or lighten the colors, the rest blend the color x with the row's */
+static void PIF_colormapRow(PIF_ColormapJob *job, int y, uint8_t *row) {
+	PIF_Palette *pal    = job->pal;
+	int          shades = job->shades;
+
+	if (y < shades) {
+		float darken = (float)(shades - y) / (float)(shades / 2);
+
+		for (int x = 0; x < pal->size; ++ x) {
+			if (x == PIF_TRANSPARENT) {
+				row[x] = PIF_TRANSPARENT;
+				continue;
+			}
+
+			int r = (int)pal->map[x].r * darken;
+			int g = (int)pal->map[x].g * darken;
+			int b = (int)pal->map[x].b * darken;
+
+			if (r > 255) r = 255;
+			if (g > 255) g = 255;
+			if (b > 255) b = 255;
+
+			PIF_Rgb rgb;
+			rgb.r = r;
+			rgb.g = g;
+			rgb.b = b;
+			row[x] = PIF_paletteIndexClosest(job->index, rgb);
+		}
+	} else {
+		y -= shades;
+		for (int x = 0; x < pal->size; ++ x) {
+			if (x == PIF_TRANSPARENT || y == PIF_TRANSPARENT)
+				row[x] = PIF_TRANSPARENT;
+			else
+				row[x] = PIF_paletteIndexClosest(job->index, PIF_rgbLerp(pal->map[x], pal->map[y], job->t));
+		}
+	}
+}
+
+static void PIF_colormapRows(void *data, int from, int to) {
+	PIF_ColormapJob *job = (PIF_ColormapJob*)data;
+	for (int y = from; y < to; ++ y)
+		PIF_colormapRow(job, y, PIF_imageAt(job->colormap, 0, y));
+}
+
+PIF_DEF PIF_Image *PIF_paletteCreateColormap(PIF_Palette *self, int shades, float t) {
+	PIF_assert(self != NULL);
+
+	PIF_ColormapJob job;
+	job.pal      = self;
+	job.index    = PIF_paletteIndexNew(self);
+	job.colormap = PIF_imageNew(self->size, self->size + shades);
+	job.shades   = shades;
+	job.t        = t;
+	PIF_parallelRows(job.colormap->h, PIF_colormapRows, &job);
+
+	PIF_paletteIndexFree(job.index);
+	return job.colormap;
+}
+
+/* Until it is built, the pixels of a lazy colormap only hold the shade rows and every blend row
+   is a separate allocation, so rows which are never used take no memory */
+typedef struct {
+	PIF_ColormapJob job;
+	int             left;             /* Amount of blend rows which are not generated yet */
+	bool            built;            /* The pixels hold the whole table */
+	uint8_t        *buf;              /* Pixels of the colormap */
+	uint8_t        *rows[PIF_COLORS]; /* Blend rows, NULL until generated */
+} PIF_LazyColormap;
+
+/* Frees the generation state once every row exists */
+static void PIF_lazyColormapFinish(PIF_LazyColormap *lazy) {
+	if (lazy->job.pal == NULL)
+		return;
+
+	PIF_paletteFree(lazy->job.pal);
+	PIF_paletteIndexFree(lazy->job.index);
+	lazy->job.pal   = NULL;
+	lazy->job.index = NULL;
+}
+
+static void PIF_lazyColormapFree(PIF_Image *colormap) {
+	PIF_LazyColormap *lazy = (PIF_LazyColormap*)colormap->lazy;
+
+	PIF_lazyColormapFinish(lazy);
+	if (!lazy->built) {
+		for (int i = 0; i < colormap->w; ++ i)
+			PIF_free(lazy->rows[i]);
+	}
+
+	PIF_free(lazy->buf);
+	PIF_free(lazy);
+	colormap->lazy = NULL;
+	colormap->buf  = NULL;
+}
+
+static uint8_t *PIF_lazyColormapRow(PIF_Image *colormap, int y) {
+	PIF_LazyColormap *lazy = (PIF_LazyColormap*)colormap->lazy;
+
+	int color = y - lazy->job.shades;
+	if (lazy->rows[color] != NULL)
+		return lazy->rows[color];
+
+	lazy->rows[color] = (uint8_t*)PIF_alloc(colormap->w);
+	PIF_checkAlloc(lazy->rows[color]);
+	PIF_colormapRow(&lazy->job, y, lazy->rows[color]);
+
+	if (-- lazy->left == 0)
+		PIF_lazyColormapFinish(lazy);
+
+	return lazy->rows[color];
+}
+
+PIF_DEF PIF_Image *PIF_paletteCreateLazyColormap(PIF_Palette *self, int shades, float t) {
+	PIF_assert(self != NULL);
+
+	PIF_LazyColormap *lazy = (PIF_LazyColormap*)PIF_alloc(sizeof(PIF_LazyColormap));
+	PIF_checkAlloc(lazy);
+	memset(lazy, 0, sizeof(PIF_LazyColormap));
+
+	/* Keep a copy of the palette, the original may be freed before the rows are generated */
+	lazy->job.pal = PIF_paletteNew(self->size);
+	memcpy(lazy->job.pal->map, self->map, self->size * sizeof(PIF_Rgb));
+
+	lazy->job.index  = PIF_paletteIndexNew(self);
+	lazy->job.shades = shades;
+	lazy->job.t      = t;
+	lazy->left       = self->size;
+
+	lazy->buf = (uint8_t*)PIF_alloc((size_t)self->size * shades + 1);
+	PIF_checkAlloc(lazy->buf);
+	for (int y = 0; y < shades; ++ y)
+		PIF_colormapRow(&lazy->job, y, lazy->buf + (size_t)y * self->size);
+
+	/* The image only owns its struct, the pixels belong to the generation state */
+	PIF_Image *colormap = PIF_imagePitchView(self->size, self->size + shades, self->size, lazy->buf);
+	colormap->lazy     = lazy;
+	lazy->job.colormap = colormap;
+	return colormap;
+}
+
+PIF_DEF void PIF_colormapBuild(PIF_Image *colormap) {
+	PIF_assert(colormap != NULL);
+
+	PIF_LazyColormap *lazy = (PIF_LazyColormap*)colormap->lazy;
+	if (lazy == NULL || lazy->built)
+		return;
+
+	/* Gather the shade rows and every blend row into the whole table */
+	int      shades = lazy->job.shades;
+	uint8_t *buf    = (uint8_t*)PIF_alloc((size_t)colormap->w * colormap->h + 1);
+	PIF_checkAlloc(buf);
+	memcpy(buf, lazy->buf, (size_t)colormap->w * shades);
+
+	for (int i = 0; i < colormap->w; ++ i) {
+		uint8_t *row = PIF_lazyColormapRow(colormap, shades + i);
+		memcpy(buf + (size_t)(shades + i) * colormap->w, row, colormap->w);
+		PIF_free(row);
+
+		lazy->rows[i] = buf + (size_t)(shades + i) * colormap->w;
+	}
+
+	PIF_free(lazy->buf);
+	lazy->buf     = buf;
+	lazy->built   = true;
+	colormap->buf = buf;
+}
+
+/* Side of the blocks of cells which share a list of candidate colors in rgbmap generation */
+#define PIF_RGBMAP_BLOCK 4
+
+typedef struct {
+	PIF_PaletteIndex *index;
+	PIF_Image        *rgbmap;
+	int               size;
+} PIF_RgbmapJob;
+
+/* Color of the rgbmap cells at the index i of a channel */
+static uint8_t PIF_rgbmapValue(int i, int size) {
+	return (float)i / (size - 1) * 255;
+}
+
+/* Squared distances from a channel value to the closest and the furthest value of a range */
+static void PIF_rangeDists(int value, int from, int to, int *minDist, int *maxDist) {
+	int min = value < from? from - value : value > to? value - to : 0;
+	int max = PIF_max(abs(value - from), abs(value - to));
+
+	*minDist += min * min;
+	*maxDist += max * max;
+}
+
+/* Generates the blue slabs of blocks from to to - 1. Only the colors which can be the closest
+   to some point of a block are searched for the cells of the block: a color whose distance to
+   the block is bigger than another color's furthest distance to it can never be the closest.
+   The candidates keep palette order, so ties are broken like in PIF_paletteClosest */
+static void PIF_rgbmapSlabs(void *data, int from, int to) {
+	PIF_RgbmapJob    *job   = (PIF_RgbmapJob*)data;
+	PIF_PaletteIndex *index = job->index;
+
+	int size = job->size;
+	for (int b0 = from * PIF_RGBMAP_BLOCK; b0 < size && b0 < to * PIF_RGBMAP_BLOCK; b0 += PIF_RGBMAP_BLOCK) {
+		int b1 = PIF_min(b0 + PIF_RGBMAP_BLOCK, size);
+		for (int g0 = 0; g0 < size; g0 += PIF_RGBMAP_BLOCK) {
+			int g1 = PIF_min(g0 + PIF_RGBMAP_BLOCK, size);
+			for (int r0 = 0; r0 < size; r0 += PIF_RGBMAP_BLOCK) {
+				int r1 = PIF_min(r0 + PIF_RGBMAP_BLOCK, size);
+
+				/* Find the candidates of the block */
+				int minDists[PIF_COLORS], bound = INT_MAX;
+				for (int pos = 0; pos < index->count; ++ pos) {
+					int minDist = 0, maxDist = 0;
+					PIF_rangeDists(index->rg[pos * 2],     PIF_rgbmapValue(r0, size),
+					               PIF_rgbmapValue(r1 - 1, size), &minDist, &maxDist);
+					PIF_rangeDists(index->rg[pos * 2 + 1], PIF_rgbmapValue(g0, size),
+					               PIF_rgbmapValue(g1 - 1, size), &minDist, &maxDist);
+					PIF_rangeDists(index->b0[pos * 2],     PIF_rgbmapValue(b0, size),
+					               PIF_rgbmapValue(b1 - 1, size), &minDist, &maxDist);
+
+					minDists[pos] = minDist;
+					bound         = PIF_min(bound, maxDist);
+				}
+
+				uint8_t cands[PIF_COLORS];
+				int     count = 0;
+				for (int pos = 0; pos < index->count; ++ pos) {
+					if (minDists[pos] <= bound)
+						cands[count ++] = pos;
+				}
+
+				/* Search the cells of the block */
+				for (int b = b0; b < b1; ++ b) {
+					for (int g = g0; g < g1; ++ g) {
+						uint8_t *row = PIF_imageAt(job->rgbmap, 0, g + b * size);
+						for (int r = r0; r < r1; ++ r) {
+							PIF_Rgb rgb;
+							rgb.r = PIF_rgbmapValue(r, size);
+							rgb.g = PIF_rgbmapValue(g, size);
+							rgb.b = PIF_rgbmapValue(b, size);
+
+							int pos = 0, minDiff = INT_MAX;
+							for (int i = 0; i < count; ++ i) {
+								int diff = PIF_indexDiff(index, cands[i], rgb);
+								if (diff < minDiff) {
+									minDiff = diff;
+									pos     = cands[i];
+								}
+							}
+							row[r] = index->color[pos];
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+PIF_DEF PIF_Image *PIF_paletteCreateRgbmap(PIF_Palette *self, uint8_t size) {
+	PIF_assert(self != NULL);
+
+	PIF_RgbmapJob job;
+	job.index  = PIF_paletteIndexNew(self);
+	job.rgbmap = PIF_imageNew(size, (int)size * size);
+	job.size   = size;
+	if (job.index->count > 0) {
+		int slabs = (size + PIF_RGBMAP_BLOCK - 1) / PIF_RGBMAP_BLOCK;
+		PIF_parallelRows(slabs, PIF_rgbmapSlabs, &job);
+	}
+
+	PIF_paletteIndexFree(job.index);
+	return job.rgbmap;
+}
+
+/* FNV-1a hash of the palette size and colors */
+PIF_DEF uint32_t PIF_paletteHash(PIF_Palette *self) {
+	PIF_assert(self != NULL);
+
+	uint32_t hash = 2166136261u;
+	hash = (hash ^ (uint8_t)(self->size - 1)) * 16777619u;
+	for (int i = 0; i < self->size; ++ i) {
+		hash = (hash ^ self->map[i].r) * 16777619u;
+		hash = (hash ^ self->map[i].g) * 16777619u;
+		hash = (hash ^ self->map[i].b) * 16777619u;
+	}
+	return hash;
+}
+
+PIF_DEF PIF_TableKey PIF_colormapKey(PIF_Palette *pal, int shades, float t) {
+	PIF_TableKey key;
+	key.type        = PIF_TABLE_COLORMAP;
+	key.paletteHash = PIF_paletteHash(pal);
+	key.param       = shades;
+	key.t           = t;
+	return key;
+}
+
+PIF_DEF PIF_TableKey PIF_rgbmapKey(PIF_Palette *pal, uint8_t size) {
+	PIF_TableKey key;
+	key.type        = PIF_TABLE_RGBMAP;
+	key.paletteHash = PIF_paletteHash(pal);
+	key.param       = size;
+	key.t           = 0;
+	return key;
+}
+
+/* Magic bytes, type, palette hash, param, t, width, height and a reserved word, then the pixels */
+#define PIF_TABLE_HEADER 32
+
+static void PIF_tableKeyToBytes(PIF_TableKey *key, uint8_t *output) {
+	uint32_t t;
+	memcpy(&t, &key->t, sizeof(t));
+
+	PIF_u32ToBytes(key->type,        output);
+	PIF_u32ToBytes(key->paletteHash, output + 4);
+	PIF_u32ToBytes(key->param,       output + 8);
+	PIF_u32ToBytes(t,                output + 12);
+}
+
+PIF_DEF PIF_Image *PIF_tableMap(const char *path, PIF_TableKey *key, const char **err) {
+	PIF_assert(path != NULL);
+	PIF_assert(key  != NULL);
+
+	size_t   size;
+	uint8_t *map = (uint8_t*)PIF_mapFile(path, &size, false);
+	if (map == NULL)
+		return (PIF_Image*)PIF_error(err, "Could not map file");
+
+	const char *msg = NULL;
+	uint8_t     keyBytes[16];
+	PIF_tableKeyToBytes(key, keyBytes);
+
+	uint32_t w = 0, h = 0;
+	if (size < PIF_TABLE_HEADER)
+		msg = "Failed to read PIF table header";
+	else if (strncmp((char*)map, PIF_TABLE_MAGIC, sizeof(PIF_TABLE_MAGIC) - 1) != 0)
+		msg = "File is not a PIF table";
+	else if (memcmp(map + 4, keyBytes, sizeof(keyBytes)) != 0)
+		msg = "PIF table key does not match";
+	else {
+		w = PIF_bytesToU32(map + 20);
+		h = PIF_bytesToU32(map + 24);
+		if (w > USHRT_MAX || h > USHRT_MAX || size != PIF_TABLE_HEADER + (size_t)w * h)
+			msg = "PIF table size does not match";
+	}
+
+	if (msg != NULL) {
+		PIF_unmapFile(map, size);
+		return (PIF_Image*)PIF_error(err, msg);
+	}
+
+	return PIF_imageFromMap(map, size, map + PIF_TABLE_HEADER, w, h);
+}
+
+PIF_DEF void PIF_tableWrite(PIF_Image *table, PIF_TableKey *key, FILE *file) {
+	PIF_assert(table != NULL);
+	PIF_assert(key   != NULL);
+	PIF_assert(file  != NULL);
+
+	PIF_colormapBuild(table);
+
+	uint8_t header[PIF_TABLE_HEADER] = {0};
+	memcpy(header, PIF_TABLE_MAGIC, sizeof(PIF_TABLE_MAGIC) - 1);
+	PIF_tableKeyToBytes(key, header + 4);
+	PIF_u32ToBytes(table->w, header + 20);
+	PIF_u32ToBytes(table->h, header + 24);
+
+	fwrite(header, 1, sizeof(header), file);
+	PIF_imageWriteBody(table, file);
+}
+
+PIF_DEF int PIF_tableSave(PIF_Image *table, PIF_TableKey *key, const char *path) {
+	PIF_assert(path != NULL);
+
+	/* Write to a temporary file first, so other processes never map a partially written table */
+	char tmpPath[FILENAME_MAX];
+	if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath))
+		return -1;
+
+	FILE *file = fopen(tmpPath, "wb");
+	if (file == NULL)
+		return -1;
+
+	PIF_tableWrite(table, key, file);
+	if (fclose(file) != 0 || rename(tmpPath, path) != 0) {
+		remove(tmpPath);
+		return -1;
+	}
+	return 0;
+}
+
+PIF_DEF PIF_Image *PIF_paletteLoadColormap(PIF_Palette *self, int shades, float t, const char *path) {
+	PIF_assert(self != NULL);
+
+	PIF_TableKey key      = PIF_colormapKey(self, shades, t);
+	PIF_Image   *colormap = PIF_tableMap(path, &key, NULL);
+	if (colormap != NULL)
+		return colormap;
+
+	/* If saving fails, the table is just generated again next time */
+	colormap = PIF_paletteCreateColormap(self, shades, t);
+	PIF_tableSave(colormap, &key, path);
+	return colormap;
+}
+
+PIF_DEF PIF_Image *PIF_paletteLoadRgbmap(PIF_Palette *self, uint8_t size, const char *path) {
+	PIF_assert(self != NULL);
+
+	PIF_TableKey key    = PIF_rgbmapKey(self, size);
+	PIF_Image   *rgbmap = PIF_tableMap(path, &key, NULL);
+	if (rgbmap != NULL)
+		return rgbmap;
+
+	rgbmap = PIF_paletteCreateRgbmap(self, size);
+	PIF_tableSave(rgbmap, &key, path);
+	return rgbmap;
+}
+
+PIF_DEF void PIF_blendShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
+	(void)x; (void)y;
+	PIF_Image *colormap = (PIF_Image*)img->data;
+	PIF_assert(colormap != NULL);
+
+	*pixel = PIF_blendColor(*pixel, color, colormap);
+}
+
+PIF_DEF void PIF_ditherShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
+	(void)img;
+
+	if (x % 2 == (y % 2 == 0))
+		*pixel = color;
+}
+
+PIF_DEF void PIF_copyShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
+	(void)color;
+	PIF_Image *src = (PIF_Image*)img->data;
+	PIF_assert(src != NULL);
+
+	*pixel = *PIF_imageAt(src, (int64_t)x * src->w / img->w, (int64_t)y * src->h / img->h);
+}
+
+PIF_DEF void PIF_blendSpanShader(int y, int x0, int x1, uint8_t *row, const uint8_t *colors,
+                                 uint8_t color, PIF_Image *img) {
+	(void)y;
+	PIF_Image *colormap = (PIF_Image*)img->data;
+	PIF_assert(colormap != NULL);
+
+	if (colors != NULL) {
+		for (int x = x0; x < x1; ++ x)
+			row[x] = PIF_blendColor(row[x], colors[x - x0], colormap);
+		return;
+	}
+
+	if (color == PIF_TRANSPARENT)
+		return;
+
+	/* All of the pixels blend with the same color, so only one row of the colormap is needed */
+	PIF_assert(colormap->h > colormap->w);
+	PIF_assert(color       < colormap->w);
+
+	uint8_t *blendRow = PIF_colormapBlendRow(colormap, color);
+	for (int x = x0; x < x1; ++ x) {
+		PIF_assert(row[x] < colormap->w);
+
+		row[x] = row[x] == PIF_TRANSPARENT? color : blendRow[row[x]];
+	}
+}
+
+PIF_DEF void PIF_ditherSpanShader(int y, int x0, int x1, uint8_t *row, const uint8_t *colors,
+                                  uint8_t color, PIF_Image *img) {
+	(void)img;
+
+	/* Same pattern as PIF_ditherShader, every pixel where x + y is odd */
+	for (int x = (x0 + y) % 2 == 0? x0 + 1 : x0; x < x1; x += 2)
+		row[x] = colors == NULL? color : colors[x - x0];
+}
+
+PIF_DEF void PIF_copySpanShader(int y, int x0, int x1, uint8_t *row, const uint8_t *colors,
+                                uint8_t color, PIF_Image *img) {
+	(void)colors; (void)color;
+	PIF_Image *src = (PIF_Image*)img->data;
+	PIF_assert(src != NULL);
+
+	uint8_t *srcRow = PIF_imageAt(src, 0, (int64_t)y * src->h / img->h);
+	PIF_assert(srcRow != NULL);
+
+	/* Step x * src->w / img->w incrementally as a quotient and a remainder */
+	int64_t pos  = (int64_t)x0 * src->w;
+	int     srcX = pos / img->w, rem = pos % img->w;
+	int     step = src->w / img->w, remStep = src->w % img->w;
+	for (int x = x0; x < x1; ++ x) {
+		row[x] = srcRow[srcX];
+
+		srcX += step;
+		rem  += remStep;
+		if (rem >= img->w) {
+			rem -= img->w;
+			++ srcX;
+		}
+	}
+}
+
+PIF_DEF void PIF_exCopyShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img) {
+	(void)color;
+	PIF_CopyInfo *info = (PIF_CopyInfo*)img->data;
+	PIF_assert(info != NULL);
+
+	int xSrc = x - (info->destRect.x + info->destRect.w / 2);
+	int ySrc = y - (info->destRect.y + info->destRect.h / 2);
+	if (info->transform) {
+		xSrc -= info->cx;
+		ySrc -= info->cy;
+		PIF_applyTransformMatrix2x2(&xSrc, &ySrc, info->mat);
+		xSrc += info->cx;
+		ySrc += info->cy;
+	}
+	xSrc = (float)(xSrc + info->ox) / info->destRect.w * info->srcRect.w + info->srcRect.w / 2;
+	ySrc = (float)(ySrc + info->oy) / info->destRect.h * info->srcRect.h + info->srcRect.h / 2;
+
+	uint8_t *src = PIF_imageAt(info->src, xSrc + info->srcRect.x, ySrc + info->srcRect.y);
+	if (src != NULL)
+		*pixel = *src;
+}
+
+PIF_DEF PIF_Image *PIF_imageNew(int w, int h) {
+	int        cap  = sizeof(PIF_Image) + w * h;
+	PIF_Image *self = (PIF_Image*)PIF_alloc(cap);
+	PIF_checkAlloc(self);
+
+	memset(self, 0, cap);
+	self->buf   = (uint8_t*)(self + 1);
+	self->w     = w;
+	self->h     = h;
+	self->size  = w * h;
+	self->pitch = w;
+	self->skipTransparent = true;
+	return self;
+}
+
+PIF_DEF PIF_Image *PIF_imageView(int w, int h, const uint8_t *buf) {
+	return PIF_imagePitchView(w, h, w, buf);
+}
+
+PIF_DEF PIF_Image *PIF_imagePitchView(int w, int h, int pitch, const uint8_t *buf) {
+	PIF_assert(buf   != NULL);
+	PIF_assert(pitch >= w);
+
+	PIF_Image *self = (PIF_Image*)PIF_alloc(sizeof(PIF_Image));
+	PIF_checkAlloc(self);
+
+	memset(self, 0, sizeof(PIF_Image));
+	self->buf   = (uint8_t*)buf;
+	self->w     = w;
+	self->h     = h;
+	self->size  = w * h;
+	self->pitch = pitch;
+	self->skipTransparent = true;
+	return self;
+}
+
+PIF_DEF PIF_Image PIF_imageSubView(PIF_Image *self, PIF_Rect *rect) {
+	PIF_assert(self != NULL);
+	PIF_assert(rect != NULL);
+	PIF_assert(rect->w >= 0 && rect->h >= 0);
+	PIF_assert(rect->x >= 0 && rect->x + rect->w <= self->w);
+	PIF_assert(rect->y >= 0 && rect->y + rect->h <= self->h);
+
+	PIF_colormapBuild(self);
+
+	PIF_Image view;
+	memset(&view, 0, sizeof(view));
+	view.shader          = self->shader;
+	view.spanShader      = self->spanShader;
+	view.data            = self->data;
+	view.skipTransparent = self->skipTransparent;
+
+	view.buf   = self->buf + (size_t)rect->y * self->pitch + rect->x;
+	view.w     = rect->w;
+	view.h     = rect->h;
+	view.size  = rect->w * rect->h;
+	view.pitch = self->pitch;
+	return view;
+}
+
+#define PIF_IMAGE_HEADER_V1 (sizeof(PIF_IMAGE_MAGIC) - 1 + 4)
+#define PIF_IMAGE_HEADER_V2 64 /* Also the alignment of the pixels in a mapped file */
+
+/* Version 1 headers are PIF_IMAGE_MAGIC followed by a 16-bit width and height. Later headers
+   are PIF_IMAGE_MAGIC_V2 and 4 zero bytes, followed by the 32-bit version, width, height,
+   pitch, flags, palette hash and the CRC of the h * pitch pixel bytes, then zeros up to the
+   pixels at PIF_IMAGE_HEADER_V2. The magic alone tells the versions apart */
+static const char *PIF_imageParseHeader(PIF_Cursor *cursor, PIF_ImageHeader *header) {
+	const uint8_t *bytes = PIF_cursorTake(cursor, sizeof(PIF_IMAGE_MAGIC) - 1);
+	if (bytes == NULL)
+		return "Failed to read magic bytes";
+
+	memset(header, 0, sizeof(PIF_ImageHeader));
+	if (memcmp(bytes, PIF_IMAGE_MAGIC, sizeof(PIF_IMAGE_MAGIC) - 1) == 0) {
+		bytes = PIF_cursorTake(cursor, 4);
+		if (bytes == NULL)
+			return "Failed to read PIF image size";
+
+		header->version = 1;
+		header->w       = PIF_bytesToU16(bytes);
+		header->h       = PIF_bytesToU16(bytes + 2);
+		header->pitch   = header->w;
+		return NULL;
+	}
+
+	if (memcmp(bytes, PIF_IMAGE_MAGIC_V2, sizeof(PIF_IMAGE_MAGIC_V2) - 1) != 0)
+		return "File is not a PIF image";
+
+	bytes = PIF_cursorTake(cursor, PIF_IMAGE_HEADER_V2 - (sizeof(PIF_IMAGE_MAGIC_V2) - 1));
+	if (bytes == NULL)
+		return "Failed to read PIF image header";
+
+	uint32_t version = PIF_bytesToU32(bytes + 4);
+	uint32_t w       = PIF_bytesToU32(bytes + 8);
+	uint32_t h       = PIF_bytesToU32(bytes + 12);
+	uint32_t pitch   = PIF_bytesToU32(bytes + 16);
+	if (version != PIF_IMAGE_VERSION)
+		return "Unsupported PIF image version";
+
+	if (w > INT_MAX || h > INT_MAX || pitch > INT_MAX)
+		return "PIF image is too large";
+
+	if (pitch < w)
+		return "PIF image pitch is smaller than its width";
+
+	header->version     = version;
+	header->w           = w;
+	header->h           = h;
+	header->pitch       = pitch;
+	header->flags       = PIF_bytesToU32(bytes + 20);
+	header->paletteHash = PIF_bytesToU32(bytes + 24);
+	header->crc         = PIF_bytesToU32(bytes + 28);
+	if (header->flags & ~(PIF_IMAGE_PALETTE | PIF_IMAGE_RLE))
+		return "Unsupported PIF image flags";
+
+	if (header->flags & PIF_IMAGE_RLE && (size_t)header->h >= SIZE_MAX / 4)
+		return "PIF image is too large";
+
+	return NULL;
+}
+
+/* Reads size bytes into buf, or skips them if buf is NULL, and continues the CRC with them */
+static int PIF_readCrc(FILE *file, uint8_t *buf, size_t size, uint32_t *crc) {
+	uint8_t skip[PIF_SPAN_MAX];
+	while (size > 0) {
+		size_t   len = buf == NULL? PIF_min(size, sizeof(skip)) : size;
+		uint8_t *to  = buf == NULL? skip : buf;
+		if (fread(to, 1, len, file) != len)
+			return -1;
+
+		*crc  = PIF_crc(*crc, to, len);
+		size -= len;
+	}
+	return 0;
+}
+
+static PIF_Sprite *PIF_spriteAlloc(int w, int h, size_t size) {
+	size_t      cap  = sizeof(PIF_Sprite) + ((size_t)h + 1) * sizeof(uint32_t) + size;
+	PIF_Sprite *self = (PIF_Sprite*)PIF_alloc(cap);
+	PIF_checkAlloc(self);
+
+	self->w    = w;
+	self->h    = h;
+	self->rows = (uint32_t*)(self + 1);
+	self->runs = (uint8_t*)(self->rows + h + 1);
+	return self;
+}
+
+/* Encodes a row into runs, or only measures it if runs is NULL. Returns the size of the runs */
+static size_t PIF_spriteEncodeRow(const uint8_t *row, int w, uint8_t *runs) {
+	size_t size = 0;
+	for (int x = 0; x < w;) {
+		int skip = 0, len = 0;
+		while (x < w && row[x] == PIF_TRANSPARENT && skip < UCHAR_MAX) {
+			++ skip;
+			++ x;
+		}
+
+		while (x < w && row[x] != PIF_TRANSPARENT && len < UCHAR_MAX) {
+			++ len;
+			++ x;
+		}
+
+		/* Transparent pixels at the end of the row are left out */
+		if (len == 0 && x == w)
+			break;
+
+		if (runs != NULL) {
+			runs[size]     = skip;
+			runs[size + 1] = len;
+			memcpy(runs + size + 2, row + x - len, len);
+		}
+		size += 2 + len;
+	}
+	return size;
+}
+
+/* Checks that the runs of every row are whole and fit in the width */
+static bool PIF_spriteValid(PIF_Sprite *self) {
+	if (self->rows[0] != 0)
+		return false;
+
+	for (int y = 0; y < self->h; ++ y) {
+		if (self->rows[y + 1] < self->rows[y] || self->rows[y + 1] > self->rows[self->h])
+			return false;
+
+		size_t i = self->rows[y], end = self->rows[y + 1], x = 0;
+		while (i < end) {
+			if (end - i < 2 || end - i - 2 < self->runs[i + 1])
+				return false;
+
+			x += self->runs[i] + self->runs[i + 1];
+			if (x > (size_t)self->w)
+				return false;
+
+			i += 2 + self->runs[i + 1];
+		}
+	}
+	return true;
+}
+
+/* Allocates a sprite for the little endian row table of a file */
+static PIF_Sprite *PIF_spriteFromTable(PIF_ImageHeader *header, const uint8_t *table) {
+	size_t      size = PIF_bytesToU32(table + (size_t)header->h * 4);
+	PIF_Sprite *self = PIF_spriteAlloc(header->w, header->h, size);
+	for (int y = 0; y <= self->h; ++ y)
+		self->rows[y] = PIF_bytesToU32(table + (size_t)y * 4);
+
+	return self;
+}
+
+/* Parses the row table and runs of a compressed image */
+static PIF_Sprite *PIF_spriteParseBody(PIF_Cursor *cursor, PIF_ImageHeader *header,
+                                       bool verify, const char **err) {
+	size_t         tableSize = ((size_t)header->h + 1) * 4;
+	const uint8_t *table     = PIF_cursorTake(cursor, tableSize);
+	if (table == NULL)
+		return (PIF_Sprite*)PIF_error(err, "Failed to read PIF sprite rows");
+
+	size_t         size = PIF_bytesToU32(table + tableSize - 4);
+	const uint8_t *runs = PIF_cursorTake(cursor, size);
+	if (runs == NULL)
+		return (PIF_Sprite*)PIF_error(err, "Failed to read PIF sprite runs");
+
+	if (verify && PIF_crc(PIF_crc(0, table, tableSize), runs, size) != header->crc)
+		return (PIF_Sprite*)PIF_error(err, "PIF image checksum does not match");
+
+	PIF_Sprite *self = PIF_spriteFromTable(header, table);
+	memcpy(self->runs, runs, size);
+	if (!PIF_spriteValid(self)) {
+		PIF_spriteFree(self);
+		return (PIF_Sprite*)PIF_error(err, "PIF sprite runs are invalid");
+	}
+	return self;
+}
+
+/* Appends size bytes of a file to a buffer holding used bytes. The buffer only grows with the
+   bytes actually read, so a bogus size in a short file cannot force a huge allocation */
+static uint8_t *PIF_readAppend(FILE *file, uint8_t *buf, size_t used, size_t size) {
+	while (size > 0) {
+		size_t len = PIF_min(size, PIF_max(used, (size_t)1 << 16));
+		buf = (uint8_t*)PIF_realloc(buf, used + len);
+		PIF_checkAlloc(buf);
+
+		if (fread(buf + used, 1, len, file) != len) {
+			PIF_free(buf);
+			return NULL;
+		}
+		used += len;
+		size -= len;
+	}
+	return buf;
+}
+
+/* Reads the row table and runs of a compressed image, then parses them like a buffer */
+static PIF_Sprite *PIF_spriteReadBody(FILE *file, PIF_ImageHeader *header, const char **err) {
+	size_t   tableSize = ((size_t)header->h + 1) * 4;
+	uint8_t *buf       = PIF_readAppend(file, NULL, 0, tableSize);
+	if (buf == NULL)
+		return (PIF_Sprite*)PIF_error(err, "Failed to read PIF sprite rows");
+
+	size_t size = PIF_bytesToU32(buf + tableSize - 4);
+	buf = PIF_readAppend(file, buf, tableSize, size);
+	if (buf == NULL)
+		return (PIF_Sprite*)PIF_error(err, "Failed to read PIF sprite runs");
+
+	PIF_Cursor  cursor = {buf, tableSize + size, 0};
+	PIF_Sprite *self   = PIF_spriteParseBody(&cursor, header, true, err);
+	PIF_free(buf);
+	return self;
+}
+
+/* Whole images are limited to INT_MAX pixels, streamed ones only have to fit the header */
+static bool PIF_imageHeaderFits(PIF_ImageHeader *header) {
+	return header->h == 0 || header->w <= INT_MAX / header->h;
+}
+
+/* Parses the pixels of an image. A borrowed image uses the pixels in the buffer instead of a
+   copy, unless the image is compressed */
+static PIF_Image *PIF_imageParseBody(PIF_Cursor *cursor, PIF_ImageHeader *header,
+                                     bool borrow, bool verify, const char **err) {
+	if (!PIF_imageHeaderFits(header))
+		return (PIF_Image*)PIF_error(err, "PIF image is too large");
+
+	if (header->flags & PIF_IMAGE_RLE) {
+		PIF_Sprite *sprite = PIF_spriteParseBody(cursor, header, verify, err);
+		if (sprite == NULL)
+			return NULL;
+
+		PIF_Image *self = PIF_spriteToImage(sprite);
+		PIF_spriteFree(sprite);
+		return self;
+	}
+
+	size_t         size = (size_t)header->pitch * header->h;
+	const uint8_t *body = PIF_cursorTake(cursor, size);
+	if (body == NULL)
+		return (PIF_Image*)PIF_error(err, "Failed to read PIF image body");
+
+	if (verify && header->version > 1 && PIF_crc(0, body, size) != header->crc)
+		return (PIF_Image*)PIF_error(err, "PIF image checksum does not match");
+
+	if (borrow)
+		return PIF_imagePitchView(header->w, header->h, header->pitch, body);
+
+	/* Copy without the padding at the end of the rows. The rows are not found with PIF_imageAt,
+	   which returns NULL for every row of an image 0 pixels wide */
+	PIF_Image *self = PIF_imageNew(header->w, header->h);
+	if (header->pitch == header->w)
+		memcpy(self->buf, body, self->size);
+	else {
+		for (int y = 0; y < self->h; ++ y)
+			memcpy(self->buf + (size_t)y * self->pitch, body + (size_t)y * header->pitch, self->w);
+	}
+	return self;
+}
+
+static PIF_Image *PIF_imageParse(PIF_Cursor *cursor, bool borrow, bool verify, const char **err) {
+	PIF_ImageHeader header;
+	const char     *msg = PIF_imageParseHeader(cursor, &header);
+	if (msg != NULL)
+		return (PIF_Image*)PIF_error(err, msg);
+
+	return PIF_imageParseBody(cursor, &header, borrow, verify, err);
+}
+
+static PIF_Image *PIF_imageReadBody(FILE *file, PIF_ImageHeader *header, const char **err) {
+	if (!PIF_imageHeaderFits(header))
+		return (PIF_Image*)PIF_error(err, "PIF image is too large");
+
+	if (header->flags & PIF_IMAGE_RLE) {
+		PIF_Sprite *sprite = PIF_spriteReadBody(file, header, err);
+		if (sprite == NULL)
+			return NULL;
+
+		PIF_Image *self = PIF_spriteToImage(sprite);
+		PIF_spriteFree(sprite);
+		return self;
+	}
+
+	PIF_Image *self = PIF_imageNew(header->w, header->h);
+
+	/* Read body, without the padding at the end of the rows */
+	uint32_t crc    = 0;
+	int      result = 0;
+	if (header->pitch == header->w)
+		result = PIF_readCrc(file, self->buf, self->size, &crc);
+	else {
+		for (int y = 0; y < self->h && result == 0; ++ y) {
+			result = PIF_readCrc(file, PIF_imageAt(self, 0, y), self->w, &crc);
+			if (result == 0)
+				result = PIF_readCrc(file, NULL, header->pitch - header->w, &crc);
+		}
+	}
+
+	const char *msg = NULL;
+	if (result != 0)
+		msg = "Failed to read PIF image body";
+	else if (header->version > 1 && crc != header->crc)
+		msg = "PIF image checksum does not match";
+
+	if (msg != NULL) {
+		PIF_imageFree(self);
+		return (PIF_Image*)PIF_error(err, msg);
+	}
+	return self;
+}
+
+PIF_DEF int PIF_imageReadHeader(FILE *file, PIF_ImageHeader *header, const char **err) {
+	PIF_assert(file   != NULL);
+	PIF_assert(header != NULL);
+
+	/* The magic says how long the rest of the header is */
+	uint8_t bytes[PIF_IMAGE_HEADER_V2];
+	size_t  size = fread(bytes, 1, sizeof(PIF_IMAGE_MAGIC_V2) - 1, file);
+	if (size == sizeof(PIF_IMAGE_MAGIC_V2) - 1 && memcmp(bytes, PIF_IMAGE_MAGIC_V2, size) == 0)
+		size += fread(bytes + size, 1, PIF_IMAGE_HEADER_V2 - size, file);
+	else
+		size += fread(bytes + size, 1, PIF_IMAGE_HEADER_V1 - size, file);
+
+	PIF_Cursor  cursor = PIF_cursorNew(bytes, size);
+	const char *msg    = PIF_imageParseHeader(&cursor, header);
+	if (msg != NULL) {
+		PIF_error(err, msg);
+		return -1;
+	}
+	return 0;
+}
+
+PIF_DEF int PIF_imageLoadHeader(const char *path, PIF_ImageHeader *header, const char **err) {
+	PIF_assert(path != NULL);
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		PIF_error(err, "Could not open file");
+		return -1;
+	}
+
+	int result = PIF_imageReadHeader(file, header, err);
+
+	fclose(file);
+	return result;
+}
+
+PIF_DEF PIF_Image *PIF_imageRead(FILE *file, const char **err) {
+	PIF_ImageHeader header;
+	if (PIF_imageReadHeader(file, &header, err) != 0)
+		return NULL;
+
+	return PIF_imageReadBody(file, &header, err);
+}
+
+PIF_DEF PIF_Image *PIF_imageReadMem(const void *data, size_t size, bool borrow, const char **err) {
+	PIF_assert(data != NULL);
+
+	PIF_Cursor cursor = PIF_cursorNew(data, size);
+	return PIF_imageParse(&cursor, borrow, true, err);
+}
+
+PIF_DEF PIF_Image *PIF_imageMap(const char *path, bool populate, const char **err) {
+	PIF_assert(path != NULL);
+
+	size_t size;
+	void  *map = PIF_mapFile(path, &size, populate);
+	if (map == NULL)
+		return (PIF_Image*)PIF_error(err, "Could not map file");
+
+	PIF_ImageHeader header;
+	PIF_Cursor      cursor = PIF_cursorNew(map, size);
+	const char     *msg    = PIF_imageParseHeader(&cursor, &header);
+	PIF_Image      *self   = NULL;
+	if (msg != NULL)
+		PIF_error(err, msg);
+	else
+		self = PIF_imageParseBody(&cursor, &header, true, false, err);
+
+	/* Compressed images are decoded, so they do not use the mapping */
+	if (self == NULL || header.flags & PIF_IMAGE_RLE) {
+		PIF_unmapFile(map, size);
+		return self;
+	}
+
+	self->map     = map;
+	self->mapSize = size;
+	return self;
+}
+
+PIF_DEF PIF_Image *PIF_imageLoad(const char *path, const char **err) {
+	PIF_assert(path != NULL);
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return (PIF_Image*)PIF_error(err, "Could not open file");
+
+	PIF_Image *self = PIF_imageRead(file, err);
+
+	fclose(file);
+	return self;
+}
+
+/* Writes a version 2 header, the pitch of the pixels is the width */
+static void PIF_imageWriteHeader(FILE *file, int w, int h, uint32_t flags, PIF_Palette *pal,
+                                 uint32_t crc) {
+	if (pal != NULL)
+		flags |= PIF_IMAGE_PALETTE;
+
+	uint8_t header[PIF_IMAGE_HEADER_V2] = {0};
+	memcpy(header, PIF_IMAGE_MAGIC_V2, sizeof(PIF_IMAGE_MAGIC_V2) - 1);
+	PIF_u32ToBytes(PIF_IMAGE_VERSION,                     header + 8);
+	PIF_u32ToBytes(w,                                     header + 12);
+	PIF_u32ToBytes(h,                                     header + 16);
+	PIF_u32ToBytes(w,                                     header + 20);
+	PIF_u32ToBytes(flags,                                 header + 24);
+	PIF_u32ToBytes(pal == NULL? 0 : PIF_paletteHash(pal), header + 28);
+	PIF_u32ToBytes(crc,                                   header + 32);
+
+	fwrite(header, 1, sizeof(header), file);
+}
+
+PIF_DEF void PIF_imageWrite(PIF_Image *self, FILE *file) {
+	PIF_imageWriteWithPalette(self, NULL, file);
+}
+
+PIF_DEF void PIF_imageWriteWithPalette(PIF_Image *self, PIF_Palette *pal, FILE *file) {
+	PIF_assert(self != NULL);
+	PIF_assert(file != NULL);
+
+	PIF_colormapBuild(self);
+
+	/* The rows are written without padding, so the pitch is the width */
+	uint32_t crc = 0;
+	for (int y = 0; y < self->h; ++ y)
+		crc = PIF_crc(crc, PIF_imageAt(self, 0, y), self->w);
+
+	PIF_imageWriteHeader(file, self->w, self->h, 0, pal, crc);
+	PIF_imageWriteBody(self, file);
+}
+
+PIF_DEF int PIF_imageSave(PIF_Image *self, const char *path) {
+	return PIF_imageSaveWithPalette(self, NULL, path);
+}
+
+PIF_DEF int PIF_imageSaveWithPalette(PIF_Image *self, PIF_Palette *pal, const char *path) {
+	PIF_assert(self != NULL);
+	PIF_assert(path != NULL);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return -1;
+
+	PIF_imageWriteWithPalette(self, pal, file);
+
+	fclose(file);
+	return 0;
+}
+
+PIF_DEF PIF_Sprite *PIF_spriteNew(PIF_Image *img, PIF_Rect *rect) {
+	PIF_assert(img != NULL);
+
+	PIF_Rect rect_ = {0, 0, img->w, img->h};
+	if (rect == NULL)
+		rect = &rect_;
+
+	PIF_assert(rect->x >= 0 && rect->w >= 0 && rect->x + rect->w <= img->w);
+	PIF_assert(rect->y >= 0 && rect->h >= 0 && rect->y + rect->h <= img->h);
+
+	PIF_colormapBuild(img);
+
+	/* Measure the runs first so the sprite is a single allocation */
+	size_t size = 0;
+	for (int y = 0; y < rect->h; ++ y)
+		size += PIF_spriteEncodeRow(PIF_imageAt(img, rect->x, rect->y + y), rect->w, NULL);
+
+	PIF_assert(size <= UINT32_MAX);
+
+	PIF_Sprite *self = PIF_spriteAlloc(rect->w, rect->h, size);
+	self->rows[0] = 0;
+	for (int y = 0; y < rect->h; ++ y) {
+		const uint8_t *row = PIF_imageAt(img, rect->x, rect->y + y);
+		self->rows[y + 1]  = self->rows[y] + PIF_spriteEncodeRow(row, rect->w,
+		                                                         self->runs + self->rows[y]);
+	}
+	return self;
+}
+
+PIF_DEF PIF_Sprite *PIF_spriteRead(FILE *file, const char **err) {
+	PIF_ImageHeader header;
+	if (PIF_imageReadHeader(file, &header, err) != 0)
+		return NULL;
+
+	if (header.flags & PIF_IMAGE_RLE)
+		return PIF_spriteReadBody(file, &header, err);
+
+	PIF_Image *img = PIF_imageReadBody(file, &header, err);
+	if (img == NULL)
+		return NULL;
+
+	PIF_Sprite *self = PIF_spriteNew(img, NULL);
+	PIF_imageFree(img);
+	return self;
+}
+
+PIF_DEF PIF_Sprite *PIF_spriteReadMem(const void *data, size_t size, const char **err) {
+	PIF_assert(data != NULL);
+
+	PIF_ImageHeader header;
+	PIF_Cursor      cursor = PIF_cursorNew(data, size);
+	const char     *msg    = PIF_imageParseHeader(&cursor, &header);
+	if (msg != NULL)
+		return (PIF_Sprite*)PIF_error(err, msg);
+
+	if (header.flags & PIF_IMAGE_RLE)
+		return PIF_spriteParseBody(&cursor, &header, true, err);
+
+	PIF_Image *img = PIF_imageParseBody(&cursor, &header, true, true, err);
+	if (img == NULL)
+		return NULL;
+
+	PIF_Sprite *self = PIF_spriteNew(img, NULL);
+	PIF_imageFree(img);
+	return self;
+}
+
+PIF_DEF PIF_Sprite *PIF_spriteLoad(const char *path, const char **err) {
+	PIF_assert(path != NULL);
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return (PIF_Sprite*)PIF_error(err, "Could not open file");
+
+	PIF_Sprite *self = PIF_spriteRead(file, err);
+
+	fclose(file);
+	return self;
+}
+
+PIF_DEF void PIF_spriteWrite(PIF_Sprite *self, FILE *file) {
+	PIF_assert(self != NULL);
+	PIF_assert(file != NULL);
+
+	size_t   tableSize = ((size_t)self->h + 1) * 4;
+	uint8_t *table     = (uint8_t*)PIF_alloc(tableSize);
+	PIF_checkAlloc(table);
+
+	for (int y = 0; y <= self->h; ++ y)
+		PIF_u32ToBytes(self->rows[y], table + (size_t)y * 4);
+
+	uint32_t crc = PIF_crc(PIF_crc(0, table, tableSize), self->runs, self->rows[self->h]);
+	PIF_imageWriteHeader(file, self->w, self->h, PIF_IMAGE_RLE, NULL, crc);
+	fwrite(table,      1, tableSize,           file);
+	fwrite(self->runs, 1, self->rows[self->h], file);
+
+	PIF_free(table);
+}
+
+PIF_DEF int PIF_spriteSave(PIF_Sprite *self, const char *path) {
+	PIF_assert(self != NULL);
+	PIF_assert(path != NULL);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return -1;
+
+	PIF_spriteWrite(self, file);
+
+	fclose(file);
+	return 0;
+}
+
+PIF_DEF PIF_Image *PIF_spriteToImage(PIF_Sprite *self) {
+	PIF_assert(self != NULL);
+
+	PIF_Image *img = PIF_imageNew(self->w, self->h);
+	for (int y = 0; y < self->h; ++ y) {
+		uint8_t *row = PIF_imageAt(img, 0, y);
+		for (uint32_t i = self->rows[y], x = 0; i < self->rows[y + 1];) {
+			int skip = self->runs[i], len = self->runs[i + 1];
+			memcpy(row + x + skip, self->runs + i + 2, len);
+
+			x += skip + len;
+			i += 2 + len;
+		}
+	}
+	return img;
+}
+
+PIF_DEF void PIF_spriteFree(PIF_Sprite *self) {
+	PIF_assert(self != NULL);
+
+	PIF_free(self);
+}
+
+static PIF_ImageStream *PIF_imageStreamNew(FILE *file, bool writing) {
+	PIF_ImageStream *self = (PIF_ImageStream*)PIF_alloc(sizeof(PIF_ImageStream));
+	PIF_checkAlloc(self);
+
+	memset(self, 0, sizeof(PIF_ImageStream));
+	self->file    = file;
+	self->writing = writing;
+	return self;
+}
+
+PIF_DEF PIF_ImageStream *PIF_imageStreamRead(FILE *file, const char **err) {
+	PIF_ImageHeader header;
+	if (PIF_imageReadHeader(file, &header, err) != 0)
+		return NULL;
+
+	if (header.flags & PIF_IMAGE_RLE)
+		return (PIF_ImageStream*)PIF_error(err, "Compressed PIF images cannot be streamed");
+
+	PIF_ImageStream *self = PIF_imageStreamNew(file, false);
+	self->header = header;
+	return self;
+}
+
+PIF_DEF PIF_ImageStream *PIF_imageStreamOpen(const char *path, const char **err) {
+	PIF_assert(path != NULL);
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return (PIF_ImageStream*)PIF_error(err, "Could not open file");
+
+	PIF_ImageStream *self = PIF_imageStreamRead(file, err);
+	if (self == NULL) {
+		fclose(file);
+		return NULL;
+	}
+
+	self->owned = true;
+	return self;
+}
+
+PIF_DEF PIF_ImageStream *PIF_imageStreamWrite(FILE *file, int w, PIF_Palette *pal) {
+	PIF_assert(file != NULL);
+	PIF_assert(w >= 0);
+
+	PIF_ImageStream *self = PIF_imageStreamNew(file, true);
+	self->start          = ftell(file);
+	self->header.version = PIF_IMAGE_VERSION;
+	self->header.w       = w;
+	self->header.pitch   = w;
+	if (pal != NULL) {
+		self->header.flags       = PIF_IMAGE_PALETTE;
+		self->header.paletteHash = PIF_paletteHash(pal);
+	}
+
+	/* Until the header is patched, the file holds an image with no rows */
+	PIF_imageWriteHeader(file, w, 0, 0, pal, 0);
+	return self;
+}
+
+PIF_DEF PIF_ImageStream *PIF_imageStreamCreate(const char *path, int w, PIF_Palette *pal,
+                                               const char **err) {
+	PIF_assert(path != NULL);
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return (PIF_ImageStream*)PIF_error(err, "Could not open file");
+
+	PIF_ImageStream *self = PIF_imageStreamWrite(file, w, pal);
+	self->owned = true;
+	return self;
+}
+
+PIF_DEF int PIF_imageStreamReadBand(PIF_ImageStream *self, uint8_t *buf, int pitch, int rows,
+                                    const char **err) {
+	PIF_assert(self != NULL);
+	PIF_assert(buf  != NULL);
+	PIF_assert(!self->writing);
+	PIF_assert(pitch >= self->header.w && rows > 0);
+
+	rows = PIF_min(rows, self->header.h - self->y);
+	if (rows <= 0)
+		return 0;
+
+	/* Rows are read one at a time unless neither side has padding */
+	PIF_ImageHeader *header = &self->header;
+	int              result = 0;
+	if (header->pitch == header->w && pitch == header->w)
+		result = PIF_readCrc(self->file, buf, (size_t)rows * pitch, &self->crc);
+	else {
+		for (int y = 0; y < rows && result == 0; ++ y) {
+			result = PIF_readCrc(self->file, buf + (size_t)y * pitch, header->w, &self->crc);
+			if (result == 0)
+				result = PIF_readCrc(self->file, NULL, header->pitch - header->w, &self->crc);
+		}
+	}
+
+	if (result != 0) {
+		PIF_error(err, "Failed to read PIF image body");
+		return -1;
+	}
+
+	self->y += rows;
+	if (self->y == header->h && header->version > 1 && self->crc != header->crc) {
+		PIF_error(err, "PIF image checksum does not match");
+		return -1;
+	}
+	return rows;
+}
+
+PIF_DEF void PIF_imageStreamWriteBand(PIF_ImageStream *self, const uint8_t *buf, int pitch,
+                                      int rows) {
+	PIF_assert(self != NULL);
+	PIF_assert(buf  != NULL);
+	PIF_assert(self->writing);
+	PIF_assert(pitch >= self->header.w && rows >= 0 && rows <= INT_MAX - self->y);
+
+	for (int y = 0; y < rows; ++ y) {
+		const uint8_t *row = buf + (size_t)y * pitch;
+		self->crc = PIF_crc(self->crc, row, self->header.w);
+		fwrite(row, 1, self->header.w, self->file);
+	}
+	self->y        += rows;
+	self->header.h  = self->y;
+}
+
+PIF_DEF int PIF_imageStreamClose(PIF_ImageStream *self) {
+	PIF_assert(self != NULL);
+
+	/* Patch the height and checksum into the header of a written file */
+	int result = 0;
+	if (self->writing) {
+		uint8_t bytes[8];
+		PIF_u32ToBytes(self->y,   bytes);
+		PIF_u32ToBytes(self->crc, bytes + 4);
+
+		if (fseek(self->file, self->start + 16, SEEK_SET) != 0 ||
+		    fwrite(bytes,     1, 4, self->file)          != 4 ||
+		    fseek(self->file, self->start + 32, SEEK_SET) != 0 ||
+		    fwrite(bytes + 4, 1, 4, self->file)          != 4 ||
+		    fseek(self->file, 0, SEEK_END) != 0 || ferror(self->file))
+			result = -1;
+	}
+
+	if (self->owned && fclose(self->file) != 0)
+		result = -1;
+
+	PIF_free(self);
+	return result;
+}
+
+static void PIF_remapFilter(PIF_Image *band, int y, void *data) {
+	(void)y;
+	PIF_imageRemap(band, (PIF_Remap*)data);
+}
+
+PIF_DEF int PIF_imageStreamFilter(PIF_ImageStream *in, PIF_ImageStream *out, int rows,
+                                  PIF_BandFilter filter, void *data, const char **err) {
+	PIF_assert(in     != NULL);
+	PIF_assert(filter != NULL);
+	PIF_assert(out == NULL || out->header.w == in->header.w);
+	PIF_assert(rows > 0);
+
+	int        w    = in->header.w;
+	PIF_Image *band = PIF_imageNew(w, w == 0? rows : PIF_min(rows, INT_MAX / w));
+	int        got, y = in->y;
+	while ((got = PIF_imageStreamReadBand(in, band->buf, band->pitch, band->h, err)) > 0) {
+		/* The last band can have fewer rows */
+		PIF_Rect  rect = {0, 0, w, got};
+		PIF_Image view = PIF_imageSubView(band, &rect);
+		filter(&view, y, data);
+
+		if (out != NULL)
+			PIF_imageStreamWriteBand(out, view.buf, view.pitch, got);
+
+		y += got;
+	}
+
+	PIF_imageFree(band);
+	return got;
+}
+
+PIF_DEF int PIF_imageStreamRemap(PIF_ImageStream *in, PIF_ImageStream *out, int rows,
+                                 PIF_Remap *remap, const char **err) {
+	PIF_assert(remap != NULL);
+
+	return PIF_imageStreamFilter(in, out, rows, PIF_remapFilter, remap, err);
+}
+
+PIF_DEF void PIF_imageFree(PIF_Image *self) {
+	PIF_assert(self != NULL);
+
+	if (self->lazy != NULL)
+		PIF_lazyColormapFree(self);
+
+	if (self->map != NULL)
+		PIF_unmapFile(self->map, self->mapSize);
+
+	PIF_free(self);
+}
+
+PIF_DEF void PIF_imageSkipTransparent(PIF_Image *self, bool enable) {
+	PIF_assert(self != NULL);
+
+	self->skipTransparent = enable;
+}
+
+static int PIF_rectArea(int x0, int y0, int x1, int y1) {
+	return (x1 - x0) * (y1 - y0);
+}
+
+/* Adds the box x0, y0 to x1 - 1, y1 - 1 to the dirty rects of the image if it tracks them */
+static void PIF_imageDirtyBox(PIF_Image *self, int x0, int y0, int x1, int y1) {
+	if (!self->dirty.track)
+		return;
+
+	x0 = PIF_max(x0, 0); x1 = PIF_min(x1, self->w);
+	y0 = PIF_max(y0, 0); y1 = PIF_min(y1, self->h);
+	if (x0 >= x1 || y0 >= y1)
+		return;
+
+	PIF_Dirty *dirty = &self->dirty;
+	PIF_Rect  *into  = NULL;
+	for (int i = 0; i < dirty->count && into == NULL; ++ i) {
+		PIF_Rect *rect = dirty->rects + i;
+		if (x0 <= rect->x + rect->w && x1 >= rect->x && y0 <= rect->y + rect->h && y1 >= rect->y)
+			into = rect;
+	}
+
+	if (into == NULL && dirty->count < PIF_DIRTY_RECTS) {
+		into = dirty->rects + dirty->count ++;
+		into->x = x0;
+		into->y = y0;
+		into->w = x1 - x0;
+		into->h = y1 - y0;
+		return;
+	}
+
+	/* Merge into the rect whose area grows the least */
+	if (into == NULL) {
+		int least = INT_MAX;
+		for (int i = 0; i < dirty->count; ++ i) {
+			PIF_Rect *rect = dirty->rects + i;
+			int growth = PIF_rectArea(PIF_min(x0, rect->x), PIF_min(y0, rect->y),
+			                          PIF_max(x1, rect->x + rect->w), PIF_max(y1, rect->y + rect->h))
+			           - rect->w * rect->h;
+			if (growth < least) {
+				least = growth;
+				into  = rect;
+			}
+		}
+	}
+
+	x1 = PIF_max(x1, into->x + into->w);
+	y1 = PIF_max(y1, into->y + into->h);
+	into->x = PIF_min(x0, into->x);
+	into->y = PIF_min(y0, into->y);
+	into->w = x1 - into->x;
+	into->h = y1 - into->y;
+}
+
+PIF_DEF void PIF_imageTrackDirty(PIF_Image *self, bool enable) {
+	PIF_assert(self != NULL);
+
+	self->dirty.track = enable;
+	self->dirty.count = 0;
+	PIF_imageDirtyBox(self, 0, 0, self->w, self->h);
+}
+
+PIF_DEF void PIF_imageMarkDirty(PIF_Image *self, PIF_Rect *rect) {
+	PIF_assert(self != NULL);
+
+	if (rect == NULL)
+		PIF_imageDirtyBox(self, 0, 0, self->w, self->h);
+	else
+		PIF_imageDirtyBox(self, rect->x, rect->y, rect->x + rect->w, rect->y + rect->h);
+}
+
+PIF_DEF void PIF_imageResetDirty(PIF_Image *self) {
+	PIF_assert(self != NULL);
+
+	self->dirty.count = 0;
+}
+
+PIF_DEF bool PIF_imageDirtyBounds(PIF_Image *self, PIF_Rect *bounds) {
+	PIF_assert(self   != NULL);
+	PIF_assert(bounds != NULL);
+
+	if (self->dirty.count == 0)
+		return false;
+
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = 0, y1 = 0;
+	for (int i = 0; i < self->dirty.count; ++ i) {
+		PIF_Rect *rect = self->dirty.rects + i;
+		x0 = PIF_min(x0, rect->x);
+		y0 = PIF_min(y0, rect->y);
+		x1 = PIF_max(x1, rect->x + rect->w);
+		y1 = PIF_max(y1, rect->y + rect->h);
+	}
+
+	bounds->x = x0;
+	bounds->y = y0;
+	bounds->w = x1 - x0;
+	bounds->h = y1 - y0;
+	return true;
+}
+
+PIF_DEF void PIF_imageSetShader(PIF_Image *self, PIF_Shader shader, void *data) {
+	PIF_assert(self != NULL);
+
+	/* Built-in shaders have span versions, other shaders are called for each pixel of a span */
+	PIF_SpanShader spanShader = NULL;
+	if      (shader == PIF_blendShader)  spanShader = PIF_blendSpanShader;
+	else if (shader == PIF_ditherShader) spanShader = PIF_ditherSpanShader;
+	else if (shader == PIF_copyShader)   spanShader = PIF_copySpanShader;
+
+	self->shader     = shader;
+	self->spanShader = spanShader;
+	self->data       = data;
+}
+
+PIF_DEF void PIF_imageSetSpanShader(PIF_Image *self, PIF_SpanShader spanShader, void *data) {
+	PIF_assert(self != NULL);
+
+	self->shader     = NULL;
+	self->spanShader = spanShader;
+	self->data       = data;
+}
+
+PIF_DEF void PIF_imageSetShaderData(PIF_Image *self, void *data) {
+	PIF_assert(self != NULL);
+
+	self->data = data;
+}
+
+PIF_DEF void PIF_imageConvertPalette(PIF_Image *self, PIF_Palette *from, PIF_Palette *to) {
+	PIF_assert(self != NULL);
+	PIF_assert(from != NULL);
+	PIF_assert(to   != NULL);
+
+	PIF_Remap remap;
+	PIF_remapInit(&remap, from, to);
+	PIF_imageRemap(self, &remap);
+}
+
+PIF_DEF void PIF_imageRemap(PIF_Image *self, PIF_Remap *remap) {
+	PIF_assert(self  != NULL);
+	PIF_assert(remap != NULL);
+
+	PIF_colormapBuild(self);
+
+	if (self->pitch == self->w)
+		PIF_remapApply(remap, self->buf, self->size);
+	else {
+		for (int y = 0; y < self->h; ++ y)
+			PIF_remapApply(remap, PIF_imageAt(self, 0, y), self->w);
+	}
+	PIF_imageDirtyBox(self, 0, 0, self->w, self->h);
+}
+
+PIF_DEF uint8_t *PIF_imageAt(PIF_Image *self, int x, int y) {
+	PIF_assert(self != NULL);
+
+	if (x < 0 || x >= self->w || y < 0 || y >= self->h)
+		return NULL;
+
+	return self->buf + (size_t)self->pitch * y + x;
+}
+
+/* Reallocates the image for a new size, the pixels are left undefined. Mapped images get their
+   own pixel buffer */
+static PIF_Image *PIF_imageRealloc(PIF_Image *self, int w, int h) {
+	if (self->lazy != NULL)
+		PIF_lazyColormapFree(self);
+
+	if (self->map != NULL) {
+		PIF_unmapFile(self->map, self->mapSize);
+		self->map = NULL;
+	}
+
+	self->w     = w;
+	self->h     = h;
+	self->size  = w * h;
+	self->pitch = w;
+	self        = (PIF_Image*)PIF_realloc(self, sizeof(PIF_Image) + self->size);
+	PIF_checkAlloc(self);
+
+	self->buf = (uint8_t*)(self + 1);
+	return self;
+}
+
+PIF_DEF PIF_Image *PIF_imageResize(PIF_Image *self, int w, int h, uint8_t color) {
+	if (self->w == w && self->h == h)
+		return self;
+
+	PIF_colormapBuild(self);
+
+	uint8_t *prevBuf = (uint8_t*)PIF_alloc(self->size);
+	PIF_checkAlloc(prevBuf);
+	for (int y = 0; y < self->h; ++ y)
+		memcpy(prevBuf + y * self->w, PIF_imageAt(self, 0, y), self->w);
+
+	int prevW = self->w, prevH = self->h;
+	self = PIF_imageRealloc(self, w, h);
+
+	memset(self->buf, color, self->size);
+
+	w = PIF_min(prevW, self->w);
+	h = PIF_min(prevH, self->h);
+	for (int y = 0; y < h; ++ y) {
+		for (int x = 0; x < w; ++ x)
+			*PIF_imageAt(self, x, y) = prevBuf[prevW * y + x];
+	}
+
+	PIF_free(prevBuf);
+
+	self->dirty.count = 0;
+	PIF_imageDirtyBox(self, 0, 0, self->w, self->h);
+	return self;
+}
+
+PIF_DEF void PIF_imageClear(PIF_Image *self, uint8_t color) {
+	PIF_assert(self != NULL);
+
+	PIF_colormapBuild(self);
+
+	if (self->pitch == self->w)
+		memset(self->buf, color, self->size);
+	else {
+		uint8_t *row = self->buf;
+		for (int y = 0; y < self->h; ++ y, row += self->pitch)
+			memset(row, color, (size_t)self->w);
+	}
+	PIF_imageDirtyBox(self, 0, 0, self->w, self->h);
+}
+
+PIF_DEF PIF_Image *PIF_imageCopy(PIF_Image *self, PIF_Image *from) {
+	if (self->lazy != NULL)
+		PIF_lazyColormapFree(self);
+
+	PIF_colormapBuild(from);
+
+	self = PIF_imageRealloc(self, from->w, from->h);
+
+	for (int y = 0; y < self->h; ++ y)
+		memcpy(PIF_imageAt(self, 0, y), PIF_imageAt(from, 0, y), self->w);
+
+	self->dirty.count = 0;
+	PIF_imageDirtyBox(self, 0, 0, self->w, self->h);
+	return self;
+}
+
+PIF_DEF PIF_Image *PIF_imageDup(PIF_Image *self) {
+	PIF_colormapBuild(self);
+
+	PIF_Image *duped = (PIF_Image*)PIF_alloc(sizeof(PIF_Image) + self->size);
+	PIF_checkAlloc(duped);
+
+	memcpy(duped, self, sizeof(PIF_Image));
+	duped->buf   = (uint8_t*)(duped + 1);
+	duped->lazy  = NULL;
+	duped->map   = NULL;
+	duped->pitch = self->w;
+	for (int y = 0; y < self->h; ++ y)
+		memcpy(PIF_imageAt(duped, 0, y), PIF_imageAt(self, 0, y), self->w);
+	return duped;
+}
+
+/* Draws the pixels x0 to x1 - 1 of the row y, clipped to the image. If colors is not NULL,
+   colors[x - x0] is the color of the pixel x, otherwise all of the pixels use color */
+static void PIF_imageDrawSpan(PIF_Image *self, int y, int x0, int x1,
+                              const uint8_t *colors, uint8_t color) {
+	if (colors == NULL && color == PIF_TRANSPARENT && self->skipTransparent)
+		return;
+
+	if (y < 0 || y >= self->h)
+		return;
+
+	if (x0 < 0) {
+		if (colors != NULL)
+			colors -= x0;
 
-	FILE *file = fopen(path, "wb");
-	if (file == NULL)
-		return -1;
+		x0 = 0;
+	}
+	if (x1 > self->w)
+		x1 = self->w;
 
-	PIF_imageWrite(self, file);
+	if (x0 >= x1)
+		return;
 
-	fclose(file);
-	return 0;
+	PIF_imageDirtyBox(self, x0, y, x1, y + 1);
+
+	uint8_t *row = PIF_imageAt(self, 0, y);
+	if (self->spanShader != NULL)
+		self->spanShader(y, x0, x1, row, colors, color, self);
+	else if (self->shader != NULL) {
+		for (int x = x0; x < x1; ++ x)
+			self->shader(x, y, row + x, colors == NULL? color : colors[x - x0], self);
+	} else if (colors == NULL)
+		memset(row + x0, color,  x1 - x0);
+	else
+		memcpy(row + x0, colors, x1 - x0);
 }
 
-PIF_DEF void PIF_imageFree(PIF_Image *self) {
-	PIF_assert(self != NULL);
+/* Copies the opaque pixels of src into dest */
+typedef void (*PIF_KeyedCopy)(uint8_t*, const uint8_t*, int);
 
-	PIF_free(self);
+static void PIF_keyedCopyScalar(uint8_t *dest, const uint8_t *src, int len) {
+	for (int i = 0; i < len; ++ i) {
+		if (src[i] != PIF_TRANSPARENT)
+			dest[i] = src[i];
+	}
 }
 
-PIF_DEF void PIF_imageSkipTransparent(PIF_Image *self, bool enable) {
-	PIF_assert(self != NULL);
+#ifdef PIF_X86_SIMD
+__attribute__((target("sse2")))
+static void PIF_keyedCopySse2(uint8_t *dest, const uint8_t *src, int len) {
+	__m128i key = _mm_set1_epi8(PIF_TRANSPARENT);
 
-	self->skipTransparent = enable;
-}
+	int i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i srcPixels = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i mask      = _mm_cmpeq_epi8(srcPixels, key);
 
-PIF_DEF void PIF_imageSetShader(PIF_Image *self, PIF_Shader shader, void *data) {
-	PIF_assert(self != NULL);
+		int bits = _mm_movemask_epi8(mask);
+		if (bits == 0xFFFF)
+			continue;
+
+		if (bits != 0) {
+			__m128i destPixels = _mm_loadu_si128((const __m128i*)(dest + i));
+			srcPixels = _mm_or_si128(_mm_and_si128(mask, destPixels),
+			                         _mm_andnot_si128(mask, srcPixels));
+		}
+		_mm_storeu_si128((__m128i*)(dest + i), srcPixels);
+	}
 
-	self->shader = shader;
-	self->data   = data;
+	PIF_keyedCopyScalar(dest + i, src + i, len - i);
 }
 
-PIF_DEF void PIF_imageSetShaderData(PIF_Image *self, void *data) {
-	PIF_assert(self != NULL);
+__attribute__((target("avx2")))
+static void PIF_keyedCopyAvx2(uint8_t *dest, const uint8_t *src, int len) {
+	__m256i key = _mm256_set1_epi8(PIF_TRANSPARENT);
 
-	self->data = data;
-}
+	int i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i srcPixels = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i mask      = _mm256_cmpeq_epi8(srcPixels, key);
 
-PIF_DEF void PIF_imageConvertPalette(PIF_Image *self, PIF_Palette *from, PIF_Palette *to) {
-	PIF_assert(self != NULL);
-	PIF_assert(from != NULL);
-	PIF_assert(to   != NULL);
+		unsigned bits = _mm256_movemask_epi8(mask);
+		if (bits == 0xFFFFFFFF)
+			continue;
 
-	for (int y = 0; y < self->h; ++ y) {
-		for (int x = 0; x < self->w; ++ x) {
-			uint8_t *pixel = PIF_imageAt(self, x, y);
-			*pixel = PIF_paletteClosest(to, from->map[*pixel]);
+		if (bits != 0) {
+			__m256i destPixels = _mm256_loadu_si256((const __m256i*)(dest + i));
+			srcPixels = _mm256_blendv_epi8(srcPixels, destPixels, mask);
 		}
+		_mm256_storeu_si256((__m256i*)(dest + i), srcPixels);
 	}
-}
 
-PIF_DEF uint8_t *PIF_imageAt(PIF_Image *self, int x, int y) {
-	PIF_assert(self != NULL);
+	PIF_keyedCopySse2(dest + i, src + i, len - i);
+}
+#endif
 
-	if (x < 0 || x >= self->w || y < 0 || y >= self->h)
-		return NULL;
+/* Picks the fastest keyed copy the CPU supports */
+static PIF_KeyedCopy PIF_keyedCopyKernel(void) {
+	static PIF_KeyedCopy kernel = NULL;
+	if (kernel != NULL)
+		return kernel;
+
+#ifdef PIF_X86_SIMD
+	__builtin_cpu_init();
+	if      (__builtin_cpu_supports("avx2")) kernel = PIF_keyedCopyAvx2;
+	else if (__builtin_cpu_supports("sse2")) kernel = PIF_keyedCopySse2;
+	else
+#endif
+		kernel = PIF_keyedCopyScalar;
 
-	return self->buf + self->w * y + x;
+	return kernel;
 }
 
-PIF_DEF PIF_Image *PIF_imageResize(PIF_Image *self, int w, int h, uint8_t color) {
-	if (self->w == w && self->h == h)
-		return self;
+/* Writes the pixels x to x + len - 1 of a row scaled by an integer ratio of 2, 3 or 4 */
+static void PIF_scaleRowInt(uint8_t *dest, const uint8_t *src, int x, int len, int ratio) {
+	src += x / ratio;
 
-	uint8_t *prevBuf = (uint8_t*)PIF_alloc(self->size);
-	PIF_checkAlloc(prevBuf);
-	memcpy(prevBuf, self->buf, self->size);
+	int i = 0;
+	if (x % ratio != 0) {
+		for (int phase = x % ratio; phase < ratio && i < len; ++ phase)
+			dest[i ++] = *src;
 
-	int prevW = self->w, prevH = self->h;
+		++ src;
+	}
 
-	self->w    = w;
-	self->h    = h;
-	self->size = w * h;
-	self       = (PIF_Image*)PIF_realloc(self, sizeof(PIF_Image) + self->size - 1);
-	PIF_checkAlloc(self);
+	switch (ratio) {
+	case 2:
+		for (; i + 4 <= len; i += 4, src += 2) {
+			dest[i]     = dest[i + 1] = src[0];
+			dest[i + 2] = dest[i + 3] = src[1];
+		}
+		break;
 
-	memset(self->buf, color, self->size);
+	case 3:
+		for (; i + 3 <= len; i += 3, ++ src)
+			dest[i] = dest[i + 1] = dest[i + 2] = *src;
+		break;
 
-	w = PIF_min(prevW, self->w);
-	h = PIF_min(prevH, self->h);
-	for (int y = 0; y < h; ++ y) {
-		for (int x = 0; x < w; ++ x)
-			*PIF_imageAt(self, x, y) = prevBuf[prevW * y + x];
+	case 4:
+		for (; i + 4 <= len; i += 4, ++ src)
+			dest[i] = dest[i + 1] = dest[i + 2] = dest[i + 3] = *src;
+		break;
+
+	default: PIF_assert(0 && "Unsupported integer scaling ratio");
 	}
 
-	PIF_free(prevBuf);
-	return self;
+	for (int phase = 0; i < len; ++ i) {
+		dest[i] = *src;
+		if (++ phase == ratio) {
+			phase = 0;
+			++ src;
+		}
+	}
 }
 
-PIF_DEF void PIF_imageClear(PIF_Image *self, uint8_t color) {
-	PIF_assert(self != NULL);
+/* Writes the pixels x to x + len - 1 of a row scaled with a 32.32 fixed point step. Pixels are
+   sampled at their centers. A non-zero ratio picks an unrolled integer ratio kernel instead */
+static void PIF_scaleRow(uint8_t *dest, const uint8_t *src, int x, int len,
+                         uint64_t step, int ratio) {
+	if (ratio != 0) {
+		PIF_scaleRowInt(dest, src, x, len, ratio);
+		return;
+	}
 
-	memset(self->buf, color, self->size);
+	uint64_t pos = step / 2 + (uint64_t)x * step;
+	for (int i = 0; i < len; ++ i, pos += step)
+		dest[i] = src[pos >> 32];
 }
 
-PIF_DEF PIF_Image *PIF_imageCopy(PIF_Image *self, PIF_Image *from) {
-	self->w    = from->w;
-	self->h    = from->h;
-	self->size = from->w * from->h;
-	self       = (PIF_Image*)PIF_realloc(self, sizeof(PIF_Image) + self->size - 1);
-	PIF_checkAlloc(self);
+/* Draws a row of len colors starting at x, skipping transparent colors if skipTransparent is
+   enabled. If color is not transparent, it is drawn in place of the row colors */
+static void PIF_imageDrawRow(PIF_Image *self, int x, int y, const uint8_t *colors, int len,
+                             bool skipTransparent, uint8_t color) {
+	for (int i = 0; i < len;) {
+		if (skipTransparent && colors[i] == PIF_TRANSPARENT) {
+			++ i;
+			continue;
+		}
 
-	memcpy(self->buf, from->buf, self->size);
-	return self;
+		int start = i;
+		while (i < len && !(skipTransparent && colors[i] == PIF_TRANSPARENT))
+			++ i;
+
+		if (color == PIF_TRANSPARENT)
+			PIF_imageDrawSpan(self, y, x + start, x + i, colors + start, PIF_TRANSPARENT);
+		else
+			PIF_imageDrawSpan(self, y, x + start, x + i, NULL, color);
+	}
 }
 
-PIF_DEF PIF_Image *PIF_imageDup(PIF_Image *self) {
-	int        cap   = sizeof(PIF_Image) + self->size - 1;
-	PIF_Image *duped = (PIF_Image*)PIF_alloc(cap);
-	memcpy(duped, self, cap);
-	return duped;
+/* Narrows the range [*from, *to) to the x where 0 <= a + b * x < size, with one pixel of slack on
+   both ends */
+static void PIF_clipAffineRange(double a, double b, double size, int *from, int *to) {
+	if (b == 0) {
+		if (a < 0 || a >= size)
+			*to = *from;
+		return;
+	}
+
+	double x0 = -a / b, x1 = (size - a) / b;
+	if (b < 0)
+		PIF_swap(x0, x1);
+
+	if (x0 - 1 > *from) *from = floor(x0) - 1;
+	if (x1 + 1 < *to)   *to   = ceil(x1)  + 1;
 }
 
 PIF_DEF void PIF_imageBlit(PIF_Image *self, PIF_Rect *destRect, PIF_Image *src, PIF_Rect *srcRect) {
 	PIF_assert(self != NULL);
 	PIF_assert(src  != NULL);
 
+	PIF_colormapBuild(src);
+
 	PIF_Rect destRect_ = {0, 0, self->w, self->h};
 	PIF_Rect srcRect_  = {0, 0, src->w,  src->h};
 	if (srcRect  == NULL) srcRect  = &srcRect_;
 	if (destRect == NULL) destRect = &destRect_;
 
-	float scaleX = (float)srcRect->w / destRect->w;
-	float scaleY = (float)srcRect->h / destRect->h;
+	if (destRect->w <= 0 || destRect->h <= 0 || srcRect->w <= 0 || srcRect->h <= 0)
+		return;
 
-	for (int y = 0; y < destRect->h; ++ y) {
-		int destY = destRect->y + y;
-		if (destY <  0)       continue;
-		if (destY >= self->h) break;
+	PIF_assert(srcRect->x >= 0 && srcRect->x + srcRect->w <= src->w);
+	PIF_assert(srcRect->y >= 0 && srcRect->y + srcRect->h <= src->h);
 
-		for (int x = 0; x < destRect->w; ++ x) {
-			int destX = destRect->x + x;
-			if (destX <  0)       continue;
-			if (destX >= self->w) break;
+	/* 32.32 fixed point source steps for each destination pixel, so sizes up to INT_MAX fit */
+	uint64_t stepX = ((uint64_t)srcRect->w << 32) / destRect->w;
+	uint64_t stepY = ((uint64_t)srcRect->h << 32) / destRect->h;
 
-			uint8_t *color = PIF_imageAt(src, scaleX * x + srcRect->x, scaleY * y + srcRect->y);
-			PIF_assert(color != NULL);
+	int ratio = 0;
+	if (destRect->w % srcRect->w == 0 && destRect->w / srcRect->w <= 4)
+		ratio = destRect->w / srcRect->w;
 
-			if (*color == PIF_TRANSPARENT && self->skipTransparent)
-				continue;
+	int xFrom = PIF_max(-destRect->x, 0);
+	int xTo   = PIF_min(self->w - destRect->x, destRect->w);
+	int yFrom = PIF_max(-destRect->y, 0);
+	int yTo   = PIF_min(self->h - destRect->y, destRect->h);
+	if (xFrom >= xTo)
+		return;
+
+	PIF_imageDirtyBox(self, destRect->x + xFrom, destRect->y + yFrom,
+	                  destRect->x + xTo, destRect->y + yTo);
+
+	/* Unshaded rows are written straight into the destination, or only copy the opaque pixels
+	   if transparency is keyed */
+	bool          unshaded  = self->shader == NULL && self->spanShader == NULL;
+	PIF_KeyedCopy keyedCopy = NULL;
+	if (unshaded && self->skipTransparent)
+		keyedCopy = PIF_keyedCopyKernel();
+
+	uint8_t colors[PIF_SPAN_MAX];
+	for (int y = yFrom; y < yTo; ++ y) {
+		int      destY  = destRect->y + y;
+		uint8_t *srcRow = PIF_imageAt(src, srcRect->x, srcRect->y + ((stepY / 2 + y * stepY) >> 32));
+		uint8_t *dest   = PIF_imageAt(self, destRect->x + xFrom, destY);
+
+		/* Unscaled rows are drawn straight from the source */
+		if (ratio == 1) {
+			if (keyedCopy != NULL)
+				keyedCopy(dest, srcRow + xFrom, xTo - xFrom);
+			else
+				PIF_imageDrawRow(self, destRect->x + xFrom, destY, srcRow + xFrom, xTo - xFrom,
+				                 self->skipTransparent, PIF_TRANSPARENT);
+			continue;
+		}
+
+		if (unshaded && keyedCopy == NULL) {
+			PIF_scaleRow(dest, srcRow, xFrom, xTo - xFrom, stepX, ratio);
+			continue;
+		}
+
+		/* Scale the source row in chunks and draw the opaque runs of each */
+		for (int x = xFrom; x < xTo; x += PIF_SPAN_MAX) {
+			int len = PIF_min(xTo - x, PIF_SPAN_MAX);
+			PIF_scaleRow(colors, srcRow, x, len, stepX, ratio);
+
+			if (keyedCopy != NULL)
+				keyedCopy(dest + x - xFrom, colors, len);
+			else
+				PIF_imageDrawRow(self, destRect->x + x, destY, colors, len,
+				                 self->skipTransparent, PIF_TRANSPARENT);
+		}
+	}
+}
+
+/* Draws the pixels from to to - 1 of a sprite row drawn at x, y clipped to the range [xFrom, xTo)
+   of the sprite. If colors is NULL, the pixels are transparent */
+static void PIF_imageDrawSpriteRun(PIF_Image *self, int x, int y, int from, int to,
+                                   int xFrom, int xTo, const uint8_t *colors, bool unshaded) {
+	if (from < xFrom) {
+		if (colors != NULL)
+			colors += xFrom - from;
+
+		from = xFrom;
+	}
+	if (to > xTo)
+		to = xTo;
+
+	if (from >= to)
+		return;
+
+	if (!unshaded)
+		PIF_imageDrawSpan(self, y, x + from, x + to, colors, PIF_TRANSPARENT);
+	else if (colors == NULL)
+		memset(PIF_imageAt(self, x + from, y), PIF_TRANSPARENT, to - from);
+	else
+		memcpy(PIF_imageAt(self, x + from, y), colors, to - from);
+}
+
+PIF_DEF void PIF_imageBlitSprite(PIF_Image *self, PIF_Sprite *sprite, int x, int y) {
+	PIF_assert(self   != NULL);
+	PIF_assert(sprite != NULL);
+
+	int xFrom = PIF_max(-x, 0);
+	int xTo   = PIF_min(self->w - x, sprite->w);
+	int yFrom = PIF_max(-y, 0);
+	int yTo   = PIF_min(self->h - y, sprite->h);
+	if (xFrom >= xTo || yFrom >= yTo)
+		return;
+
+	/* Unshaded runs are copied straight into the destination, shaded ones are drawn as spans */
+	bool unshaded = self->shader == NULL && self->spanShader == NULL;
+	if (unshaded)
+		PIF_imageDirtyBox(self, x + xFrom, y + yFrom, x + xTo, y + yTo);
+
+	for (int row = yFrom; row < yTo; ++ row) {
+		const uint8_t *runs = sprite->runs + sprite->rows[row];
+		const uint8_t *end  = sprite->runs + sprite->rows[row + 1];
+
+		/* Only the opaque runs are copied when skipping transparent pixels */
+		if (unshaded && self->skipTransparent) {
+			uint8_t *dest = PIF_imageAt(self, 0, y + row);
+			for (int pos = 0; runs < end && pos < xTo;) {
+				int            len    = runs[1];
+				const uint8_t *colors = runs + 2;
+				pos  += runs[0];
+				runs += 2 + len;
+
+				int from = PIF_max(pos, xFrom), to = PIF_min(pos + len, xTo);
+				if (from < to)
+					memcpy(dest + x + from, colors + from - pos, to - from);
+
+				pos += len;
+			}
+			continue;
+		}
+
+		/* Walk the runs up to the right edge, the pixels after the last run are transparent */
+		for (int pos = 0; pos < xTo;) {
+			int            skip   = sprite->w - pos, len = 0;
+			const uint8_t *colors = NULL;
+			if (runs < end) {
+				skip   = runs[0];
+				len    = runs[1];
+				colors = runs + 2;
+				runs  += 2 + len;
+			}
 
-			PIF_imageDrawPoint(self, destX, destY, *color);
+			if (!self->skipTransparent)
+				PIF_imageDrawSpriteRun(self, x, y + row, pos, pos + skip, xFrom, xTo,
+				                       NULL, unshaded);
+
+			pos += skip;
+			if (len > 0)
+				PIF_imageDrawSpriteRun(self, x, y + row, pos, pos + len, xFrom, xTo,
+				                       colors, unshaded);
+
+			pos += len;
 		}
 	}
 }
@@ -665,26 +3178,102 @@ PIF_DEF void PIF_imageTransformBlit(PIF_Image *self, PIF_Rect *destRect, PIF_Ima
 	PIF_assert(self != NULL);
 	PIF_assert(src  != NULL);
 
+	PIF_colormapBuild(src);
+
 	PIF_Rect destRect_ = {0, 0, self->w, self->h};
 	PIF_Rect srcRect_  = {0, 0, src->w,  src->h};
 	if (srcRect  == NULL) srcRect  = &srcRect_;
 	if (destRect == NULL) destRect = &destRect_;
 
-	PIF_CopyInfo copyInfo;
-	PIF_zeroStruct(&copyInfo);
-	copyInfo.src       = src;
-	copyInfo.srcRect   = *srcRect;
-	copyInfo.destRect  = *destRect;
-	copyInfo.ox        = -cx;
-	copyInfo.oy        = -cy;
-	copyInfo.transform = true;
-	PIF_invertMatrix2x2(mat, copyInfo.mat);
+	if (destRect->w <= 0 || destRect->h <= 0 || srcRect->w <= 0 || srcRect->h <= 0)
+		return;
+
+	PIF_assert(srcRect->x >= 0 && srcRect->x + srcRect->w <= src->w);
+	PIF_assert(srcRect->y >= 0 && srcRect->y + srcRect->h <= src->h);
+
+	float inv[2][2];
+	if (!PIF_invertMatrix2x2(mat, inv))
+		return;
+
+	/* The rect is transformed around (cx, cy) relative to its center, which is placed at the
+	   center of destRect (see PIF_transformRect). A destination pixel center maps back to the
+	   rect as (x + 0.5 - ox) * inv + half - c, which is then scaled to the source rect */
+	int    ox = destRect->x + destRect->w / 2, oy = destRect->y + destRect->h / 2;
+	double hx = destRect->w / 2 - cx,          hy = destRect->h / 2 - cy;
+	double su = (double)srcRect->w / destRect->w;
+	double sv = (double)srcRect->h / destRect->h;
+
+	/* Clip the bounding box of the transformed rect to the destination once */
+	double minX = self->w, minY = self->h, maxX = 0, maxY = 0;
+	for (int i = 0; i < 4; ++ i) {
+		double px = (i & 1? destRect->w : 0) - hx, py = (i & 2? destRect->h : 0) - hy;
+		double x  = px * mat[0][0] + py * mat[1][0] + ox;
+		double y  = px * mat[0][1] + py * mat[1][1] + oy;
+		minX = PIF_min(minX, x); maxX = PIF_max(maxX, x);
+		minY = PIF_min(minY, y); maxY = PIF_max(maxY, y);
+	}
+	int xFrom = PIF_max(floor(minX) - 1, 0), xTo = PIF_min(ceil(maxX) + 1, self->w);
+	int yFrom = PIF_max(floor(minY) - 1, 0), yTo = PIF_min(ceil(maxY) + 1, self->h);
+	if (xFrom >= xTo)
+		return;
+
+	PIF_imageDirtyBox(self, xFrom, yFrom, xTo, yTo);
+
+	/* 16.16 fixed point source steps along a destination row */
+	int64_t du = llround(inv[0][0] * su * 65536), dv = llround(inv[0][1] * sv * 65536);
+	int64_t uMax = (int64_t)srcRect->w << 16,     vMax = (int64_t)srcRect->h << 16;
+
+	bool          unshaded  = self->shader == NULL && self->spanShader == NULL;
+	PIF_KeyedCopy keyedCopy = NULL;
+	if (unshaded && self->skipTransparent)
+		keyedCopy = PIF_keyedCopyKernel();
+
+	uint8_t *srcBuf = PIF_imageAt(src, srcRect->x, srcRect->y);
+	uint8_t  colors[PIF_SPAN_MAX];
+	for (int y = yFrom; y < yTo; ++ y) {
+		double dy = y + 0.5 - oy;
+		double ua = ((0.5 - ox) * inv[0][0] + dy * inv[1][0] + hx) * su;
+		double va = ((0.5 - ox) * inv[0][1] + dy * inv[1][1] + hy) * sv;
+
+		/* Estimate the span where the source coordinates are inside the source rect */
+		int from = xFrom, to = xTo;
+		PIF_clipAffineRange(ua, inv[0][0] * su, srcRect->w, &from, &to);
+		PIF_clipAffineRange(va, inv[0][1] * sv, srcRect->h, &from, &to);
+		if (from >= to)
+			continue;
+
+		/* Then find its exact edges in fixed point, so no pixel inside needs bounds checks */
+		int64_t u = llround((ua + from * inv[0][0] * su) * 65536);
+		int64_t v = llround((va + from * inv[0][1] * sv) * 65536);
+		while (from < to && (u < 0 || u >= uMax || v < 0 || v >= vMax)) {
+			++ from;
+			u += du;
+			v += dv;
+		}
+		while (from < to) {
+			int64_t uLast = u + (to - 1 - from) * du, vLast = v + (to - 1 - from) * dv;
+			if (uLast >= 0 && uLast < uMax && vLast >= 0 && vLast < vMax)
+				break;
+
+			-- to;
+		}
+
+		uint8_t *dest = PIF_imageAt(self, 0, y);
+		for (int x = from; x < to; x += PIF_SPAN_MAX) {
+			int      len = PIF_min(to - x, PIF_SPAN_MAX);
+			uint8_t *out = unshaded && keyedCopy == NULL? dest + x : colors;
+			for (int i = 0; i < len; ++ i, u += du, v += dv)
+				out[i] = srcBuf[(v >> 16) * src->pitch + (u >> 16)];
+
+			if (out == dest + x)
+				continue;
 
-	PIF_Shader prevShader = self->shader;
-	void      *prevData   = self->data;
-	PIF_imageSetShader(self, PIF_exCopyShader, &copyInfo);
-	PIF_imageFillTransformRect(self, destRect, 1, mat, cx, cy);
-	PIF_imageSetShader(self, prevShader, prevData);
+			if (keyedCopy != NULL)
+				keyedCopy(dest + x, colors, len);
+			else
+				PIF_imageDrawRow(self, x, y, colors, len, self->skipTransparent, PIF_TRANSPARENT);
+		}
+	}
 }
 
 PIF_DEF void PIF_imageRotateBlit(PIF_Image *self, PIF_Rect *destRect, PIF_Image *src,
@@ -694,6 +3283,16 @@ PIF_DEF void PIF_imageRotateBlit(PIF_Image *self, PIF_Rect *destRect, PIF_Image
 	PIF_imageTransformBlit(self, destRect, src, srcRect, rotMat, cx, cy);
 }
 
+/* Shades the pixel at x, y which the caller has already clipped */
+static void PIF_imageShadePoint(PIF_Image *self, int x, int y, uint8_t *pixel, uint8_t color) {
+	if (self->shader != NULL)
+		self->shader(x, y, pixel, color, self);
+	else if (self->spanShader != NULL)
+		self->spanShader(y, x, x + 1, pixel - x, NULL, color, self);
+	else
+		*pixel = color;
+}
+
 PIF_DEF void PIF_imageDrawPoint(PIF_Image *self, int x, int y, uint8_t color) {
 	PIF_assert(self != NULL);
 
@@ -701,18 +3300,14 @@ PIF_DEF void PIF_imageDrawPoint(PIF_Image *self, int x, int y, uint8_t color) {
 		return;
 
 	uint8_t *pixel = PIF_imageAt(self, x, y);
-	if (pixel == NULL)
-		return;
-
-	if (self->shader == NULL) {
-		*pixel = color;
-		return;
+	if (pixel != NULL) {
+		PIF_imageDirtyBox(self, x, y, x + 1, y + 1);
+		PIF_imageShadePoint(self, x, y, pixel, color);
 	}
-
-	self->shader(x, y, pixel, color, self);
 }
 
-/* Bresenham's line algorithm */
+/* Bresenham's line algorithm. The line is clipped to the image before it is walked, but the step
+   i still counts from the start of the line, so the dash pattern does not change when clipped */
 PIF_DEF void PIF_imageDrawLine(PIF_Image *self, int x1, int y1, int x2, int y2,
                                int n, uint8_t color) {
 	PIF_assert(self != NULL);
@@ -720,6 +3315,11 @@ PIF_DEF void PIF_imageDrawLine(PIF_Image *self, int x1, int y1, int x2, int y2,
 	if (color == PIF_TRANSPARENT && self->skipTransparent)
 		return;
 
+	/* The far corner is clamped first so it can not overflow */
+	PIF_imageDirtyBox(self, PIF_min(x1, x2), PIF_min(y1, y2),
+	                  PIF_min(PIF_max(x1, x2), self->w - 1) + 1,
+	                  PIF_min(PIF_max(y1, y2), self->h - 1) + 1);
+
 	bool swap = abs(y2 - y1) > abs(x2 - x1);
 	if (swap) {
 		PIF_swap(x1, y1);
@@ -731,22 +3331,76 @@ PIF_DEF void PIF_imageDrawLine(PIF_Image *self, int x1, int y1, int x2, int y2,
 		PIF_swap(y1, y2);
 	}
 
-	int   distX = x2 - x1;
-	int   distY = abs(y2 - y1);
-	float err   = distX / 2;
-	int   stepY = y1 < y2? 1 : -1;
+	int distX = x2 - x1;
+	int distY = abs(y2 - y1);
+	int err   = distX / 2;
+	int stepY = y1 < y2? 1 : -1;
+
+	/* Size of the image along the major and the minor axis */
+	int sizeX = swap? self->h : self->w;
+	int sizeY = swap? self->w : self->h;
+
+	int64_t from = PIF_max(0, -(int64_t)x1);
+	int64_t to   = PIF_min((int64_t)distX, (int64_t)sizeX - 1 - x1);
+	if (distY == 0) {
+		if (y1 < 0 || y1 >= sizeY)
+			return;
+	} else {
+		/* After i steps the line has moved ceil((i * distY - err) / distX) pixels on the minor
+		   axis, which has to stay between low and high to be inside the image */
+		int64_t low  = stepY > 0? -(int64_t)y1 : (int64_t)y1 - sizeY + 1;
+		int64_t high = stepY > 0? (int64_t)sizeY - 1 - y1 : y1;
+		if (high < 0)
+			return;
+
+		if (low > 0)
+			from = PIF_max(from, ((low - 1) * distX + err) / distY + 1);
+
+		to = PIF_min(to, (high * distX + err) / distY);
+	}
+
+	if (from > to)
+		return;
+
+	/* Jump to the first visible step */
+	int64_t moved = from * distY - err;
+	moved = moved > 0? (moved + distX - 1) / distX : 0;
+
+	err = (int)(err - from * distY + moved * distX);
+	x1 += (int)from;
+	y1 += (int)(stepY * moved);
+
+	if (distY == 0) {
+		/* Horizontal lines are drawn as spans and vertical lines as columns, one per dash */
+		for (int64_t i = from; i <= to;) {
+			int64_t end = n > 0? PIF_min((i / n + 1) * n, to + 1) : to + 1;
+			if (n <= 0 || i / n % 2 == 1) {
+				int start = x1 + (int)(i - from), len = (int)(end - i);
+				if (!swap)
+					PIF_imageDrawSpan(self, y1, start, start + len, NULL, color);
+				else {
+					uint8_t *pixel = PIF_imageAt(self, y1, start);
+					for (int j = 0; j < len; ++ j, pixel += self->pitch) {
+						if (self->shader == NULL && self->spanShader == NULL)
+							*pixel = color;
+						else
+							PIF_imageShadePoint(self, y1, start + j, pixel, color);
+					}
+				}
+			}
 
-	bool draw = true;
-	for (int i = 0; x1 <= x2; ++ i) {
-		if (n > 0 && i % n == 0)
-			draw = !draw;
+			i = end;
+		}
+		return;
+	}
 
-		if (draw) {
+	for (int64_t i = from; i <= to; ++ i) {
+		if (n <= 0 || i / n % 2 == 1) {
 			int x = x1, y = y1;
 			if (swap)
 				PIF_swap(x, y);
 
-			PIF_imageDrawPoint(self, x, y, color);
+			PIF_imageShadePoint(self, x, y, self->buf + (size_t)y * self->pitch + x, color);
 		}
 
 		err -= distY;
@@ -776,46 +3430,159 @@ PIF_DEF void PIF_imageDrawRect(PIF_Image *self, PIF_Rect *rect, int n, uint8_t c
 	                  rect->x + 1, rect->y + rect->h - 1, n, color);
 }
 
-/* Midpoint circle algorithm */
+/* Midpoint circle algorithm. Every step (x, y) with x >= y >= 0 is mirrored into the 8 octants,
+   the octants are walked in arc order so the dash pattern continues around the circle. The points
+   on the octant boundaries (y = 0 and x = y) only belong to one of the two octants */
+typedef struct {
+	int x, y, dx, dy, err, r;
+} PIF_CircleWalk;
+
+/* Integer square root, rounded down */
+static int64_t PIF_isqrt(int64_t v) {
+	int64_t s = sqrt((double)v);
+	while (s * s > v)
+		-- s;
+	while ((s + 1) * (s + 1) <= v)
+		++ s;
+	return s;
+}
+
+/* Step y of the walk. y grows by 1 every step and x is the largest with x * x + y * y <= r * r,
+   except for the first step where it is r - 1. err is x * x + y * y - r * r */
+static PIF_CircleWalk PIF_circleWalkAt(int r, int y) {
+	PIF_CircleWalk walk;
+	walk.x   = y == 0? r - 1 : PIF_isqrt((int64_t)r * r - (int64_t)y * y);
+	walk.y   = y;
+	walk.dx  = 2 * (r - walk.x) - 1;
+	walk.dy  = 2 * y + 1;
+	walk.err = (int64_t)walk.x * walk.x + (int64_t)y * y - (int64_t)r * r;
+	walk.r   = r;
+	return walk;
+}
+
+static void PIF_circleWalkStep(PIF_CircleWalk *walk) {
+	if (walk->err <= 0) {
+		walk->y   ++;
+		walk->err += walk->dy;
+		walk->dy  += 2;
+	}
+
+	if (walk->err > 0) {
+		walk->x   --;
+		walk->dx  += 2;
+		walk->err += walk->dx - (walk->r << 1);
+	}
+}
+
+/* Swap x and y, x sign, y sign */
+static const int PIF_octants[8][3] = {
+	{0,  1,  1}, {1,  1,  1}, {1, -1,  1}, {0, -1,  1},
+	{0, -1, -1}, {1, -1, -1}, {1,  1, -1}, {0,  1, -1},
+};
+
+/* Range of v for which c + sign * v is within 0 and size - 1 */
+static void PIF_axisRange(int c, int sign, int size, int64_t *from, int64_t *to) {
+	*from = sign > 0? -(int64_t)c             : (int64_t)c - size + 1;
+	*to   = sign > 0? (int64_t)size - 1 - c : c;
+}
+
+/* Range of the steps of an octant whose points fall inside of the image. The y of the walk maps
+   to one axis and its x to the other, x only shrinks as y grows so both give a range of steps.
+   The range is empty, with from > to, if no point is inside */
+static void PIF_circleOctantRange(PIF_Image *self, int cx, int cy, int r, int octant, int steps,
+                                  int *from, int *to) {
+	const int *o = PIF_octants[octant];
+
+	int64_t xFrom, xTo, yFrom, yTo;
+	PIF_axisRange(cx, o[1], self->w, o[0]? &yFrom : &xFrom, o[0]? &yTo : &xTo);
+	PIF_axisRange(cy, o[2], self->h, o[0]? &xFrom : &yFrom, o[0]? &xTo : &yTo);
+	if (xTo < 0 || xFrom > r - 1) {
+		*from = 0;
+		*to   = -1;
+		return;
+	}
+
+	/* x is at most xTo once y is past the root for xTo + 1, and at least xFrom up to its root */
+	int64_t rr = (int64_t)r * r;
+	if (xTo < r - 1)
+		yFrom = PIF_max(yFrom, PIF_isqrt(rr - (xTo + 1) * (xTo + 1)) + 1);
+	if (xFrom > 0)
+		yTo = PIF_min(yTo, PIF_isqrt(rr - xFrom * xFrom));
+
+	*from = PIF_max(yFrom, 0);
+	*to   = PIF_min(yTo, steps - 1);
+}
+
 PIF_DEF void PIF_imageDrawCircle(PIF_Image *self, int cx, int cy, int r, int n, uint8_t color) {
 	PIF_assert(self != NULL);
 
 	if (color == PIF_TRANSPARENT && self->skipTransparent)
 		return;
 
-	int x   = r - 1;
-	int y   = 0;
-	int dx  = 1;
-	int dy  = 1;
-	int err = dx - (r << 1);
-
-	bool draw = true;
-	for (int i = 0; x >= y; ++ i) {
-		if (n > 0 && i % n == 0)
-			draw = !draw;
-
-		if (draw) {
-			/* TODO: Fix overdrawing pixels */
-			PIF_imageDrawPoint(self, cx + x, cy + y, color);
-			PIF_imageDrawPoint(self, cx + y, cy + x, color);
-			PIF_imageDrawPoint(self, cx - y, cy + x, color);
-			PIF_imageDrawPoint(self, cx - x, cy + y, color);
-			PIF_imageDrawPoint(self, cx - x, cy - y, color);
-			PIF_imageDrawPoint(self, cx - y, cy - x, color);
-			PIF_imageDrawPoint(self, cx + y, cy - x, color);
-			PIF_imageDrawPoint(self, cx + x, cy - y, color);
-		}
+	if (r <= 0 || cx + r <= 0 || cy + r <= 0 || cx - r >= self->w - 1 || cy - r >= self->h - 1)
+		return;
 
-		if (err <= 0) {
-			y   ++;
-			err += dy;
-			dy  += 2;
+	if (r == 1) {
+		if (n <= 0)
+			PIF_imageDrawPoint(self, cx, cy, color);
+
+		return;
+	}
+
+	/* An octant goes on while x >= y, so up to the last y with 2 * y * y <= r * r */
+	int  steps  = PIF_isqrt((int64_t)r * r / 2) + 1;
+	bool diag   = PIF_circleWalkAt(r, steps - 1).x == steps - 1;
+	int  period = steps * 2 - 1 - diag; /* Points in each pair of octants */
+
+	/* Only walk the steps of each octant which are inside of the image, and only mark the box of
+	   those steps as dirty */
+	int from[8], to[8];
+	int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+	for (int i = 0; i < 8; ++ i) {
+		PIF_circleOctantRange(self, cx, cy, r, i, steps, &from[i], &to[i]);
+
+		/* Even octants go from y = 0 to the diagonal and own the point on the axis, odd octants
+		   go back from the diagonal to the axis and own the point on the diagonal */
+		if (i % 2 == 0 && diag)
+			to[i] = PIF_min(to[i], steps - 2);
+		else if (i % 2 == 1)
+			from[i] = PIF_max(from[i], 1);
+
+		if (from[i] > to[i])
+			continue;
+
+		/* x and y only go one way along an octant, so its first and last steps bound it */
+		const int *o = PIF_octants[i];
+		for (int k = 0; k < 2; ++ k) {
+			PIF_CircleWalk walk = PIF_circleWalkAt(r, k == 0? from[i] : to[i]);
+			int x = cx + o[1] * (o[0]? walk.y : walk.x);
+			int y = cy + o[2] * (o[0]? walk.x : walk.y);
+			x0 = PIF_min(x0, x);
+			y0 = PIF_min(y0, y);
+			x1 = PIF_max(x1, x);
+			y1 = PIF_max(y1, y);
 		}
+	}
+
+	if (x0 > x1)
+		return;
+
+	PIF_imageDirtyBox(self, x0, y0, x1 + 1, y1 + 1);
+
+	for (int j = 0; j < 8; ++ j) {
+		if (from[j] > to[j])
+			continue;
 
-		if (err > 0) {
-			x   --;
-			dx  += 2;
-			err += dx - (r << 1);
+		const int     *o    = PIF_octants[j];
+		PIF_CircleWalk walk = PIF_circleWalkAt(r, from[j]);
+		for (int i = from[j]; i <= to[j]; ++ i, PIF_circleWalkStep(&walk)) {
+			int pos = j / 2 * period + (j % 2 == 0? i : steps - diag + steps - 1 - i);
+			if (n > 0 && pos / n % 2 == 0)
+				continue;
+
+			int x = cx + o[1] * (o[0]? walk.y : walk.x);
+			int y = cy + o[2] * (o[0]? walk.x : walk.y);
+			PIF_imageShadePoint(self, x, y, self->buf + (size_t)y * self->pitch + x, color);
 		}
 	}
 }
@@ -869,17 +3636,19 @@ PIF_DEF void PIF_imageFillRect(PIF_Image *self, PIF_Rect *rect, uint8_t color) {
 	if (rect == NULL)
 		rect = &rect_;
 
-	for (int y = rect->y; y < rect->y + rect->h; ++ y) {
-		if (y <  0)       continue;
-		if (y >= self->h) break;
+	int yFrom = PIF_max(rect->y, 0);
+	int yTo   = PIF_min(rect->y + rect->h, self->h);
 
-		for (int x = rect->x; x < rect->x + rect->w; ++ x) {
-			if (x <  0)       continue;
-			if (x >= self->w) break;
-
-			PIF_imageDrawPoint(self, x, y, color);
-		}
+	/* Unshaded rects spanning whole rows are one contiguous block */
+	if (self->shader == NULL && self->spanShader == NULL && yFrom < yTo &&
+	    rect->x <= 0 && rect->x + rect->w >= self->w && self->pitch == self->w) {
+		memset(PIF_imageAt(self, 0, yFrom), color, (yTo - yFrom) * self->w);
+		PIF_imageDirtyBox(self, 0, yFrom, self->w, yTo);
+		return;
 	}
+
+	for (int y = yFrom; y < yTo; ++ y)
+		PIF_imageDrawSpan(self, y, rect->x, rect->x + rect->w, NULL, color);
 }
 
 PIF_DEF void PIF_imageFillCircle(PIF_Image *self, int cx, int cy, int r, uint8_t color) {
@@ -888,102 +3657,230 @@ PIF_DEF void PIF_imageFillCircle(PIF_Image *self, int cx, int cy, int r, uint8_t
 	if (color == PIF_TRANSPARENT && self->skipTransparent)
 		return;
 
-	int d  = r * 2;
-	int rr = r * r;
-	for (int y = 0; y < d; ++ y) {
-		int dy    = r - y;
-		int destY = cy + dy;
-		if (destY <  0)       break;
-		if (destY >= self->h) continue;
-
-		for (int x = 0; x < d; ++ x) {
-			int dx    = r - x;
-			int destX = cx + dx;
-			if (destX <  0)       break;
-			if (destX >= self->w) continue;
-
-			int dy = r - y;
-			if (dx * dx + dy * dy < rr)
-				PIF_imageDrawPoint(self, destX, destY, color);
-		}
-	}
-}
+	if (r <= 0)
+		return;
 
-static void PIF_imageFillFlatSideTriangle(PIF_Image *self, int x1, int y1, int x2, int y2,
-                                          int x3, uint8_t color, bool skipLast) {
-	if (x2 > x3)
-		PIF_swap(x2, x3);
+	/* Only the rows inside of the image are visited */
+	int yFrom = PIF_max(cy - r + 1, 0), yTo = PIF_min(cy + r - 1, self->h - 1);
+	if (yFrom > yTo)
+		return;
 
-	float slopeA = (float)(x2 - x1) / (y2 - y1);
-	float slopeB = (float)(x3 - x1) / (y2 - y1);
+	/* Range of the vertical distances from the center of the visible rows */
+	int dFrom = 0, dTo = PIF_max(cy - yFrom, yTo - cy);
+	if      (cy < yFrom) dFrom = yFrom - cy;
+	else if (cy > yTo)   dFrom = cy - yTo;
+
+	/* Half width m of the row at distance d is the largest m with m * m + d * d < r * r. It only
+	   shrinks as d grows, so it is found once and then stepped with integer squares */
+	int64_t rr = (int64_t)r * r, dd = (int64_t)dFrom * dFrom;
+	int     m  = sqrt((double)(rr - dd));
+	while ((int64_t)m * m + dd >= rr)
+		-- m;
+
+	int64_t mm = (int64_t)m * m;
+	for (int d = dFrom; d <= dTo; ++ d) {
+		while (mm + dd >= rr) {
+			mm -= 2 * m - 1;
+			-- m;
+		}
 
-	float xStart = x1, xEnd = x1, yStep = 1;
-	if (y2 == y1) {
-		xStart = PIF_min(xStart, x2);
-		xEnd   = PIF_max(xEnd,   x3);
-	}
+		PIF_imageDrawSpan(self, cy + d, cx - m, cx + m + 1, NULL, color);
+		if (d != 0)
+			PIF_imageDrawSpan(self, cy - d, cx - m, cx + m + 1, NULL, color);
 
-	if (y1 > y2) {
-		slopeA *= -1;
-		slopeB *= -1;
-		yStep  *= -1;
+		dd += 2 * d + 1;
 	}
+}
 
-	float xPrevEnd = xStart, xPrevStart = xEnd;
-	int   yStop    = skipLast? y2 : y2 + yStep;
-	/* skipLast is required to avoid an overlap with the 2 flat side triangles used to render a
-	   normal triangle */
-	for (int y = y1; y != yStop; y += yStep) {
-		if ((yStep > 0 && y >= self->h) || (yStep < 0 && y < 0))
-			break;
+/* Edge function of the edge from (x1, y1) to (x2, y2). Coordinates are doubled so pixel centers
+   land on integers. The top-left fill rule is folded into the starting value, so a pixel is on
+   the inner side of the edge if the value is not negative */
+typedef struct {
+	int64_t e, stepX, stepY;
+} PIF_Edge;
+
+static PIF_Edge PIF_edgeNew(int x1, int y1, int x2, int y2, int x, int y) {
+	int64_t dx = (int64_t)x2 - x1, dy = (int64_t)y2 - y1;
+
+	/* The triangle is wound so its inside is to the right of each edge. Top edges are horizontal
+	   and go right, left edges go up */
+	bool topLeft = (dy == 0 && dx > 0) || dy < 0;
+
+	PIF_Edge edge;
+	edge.e     = 2 * dx * (2 * ((int64_t)y - y1) + 1) - 2 * dy * (2 * ((int64_t)x - x1) + 1);
+	edge.e    -= topLeft? 0 : 1;
+	edge.stepX = -4 * dy;
+	edge.stepY =  4 * dx;
+	return edge;
+}
+
+/* Triangles with coordinates past the guard band are clipped to it first, which keeps the edge
+   functions of the rasterizer within 64 bits */
+#define PIF_GUARD_BAND (1 << 28)
+
+/* Clips a polygon to the side of the guard band at sign * PIF_GUARD_BAND on the axis (0 for x,
+   1 for y). The crossing of an edge is computed from its endpoints in a fixed order, so an edge
+   shared by two triangles is clipped to the same point in both. Returns the amount of points */
+static int PIF_clipGuardBand(int (*from)[2], int n, int (*to)[2], int axis, int sign) {
+	int count = 0;
+	for (int i = 0; i < n; ++ i) {
+		int *a = from[i], *b = from[(i + 1) % n];
+		bool aIn = (int64_t)a[axis] * sign <= PIF_GUARD_BAND;
+		bool bIn = (int64_t)b[axis] * sign <= PIF_GUARD_BAND;
+		if (aIn) {
+			to[count][0] = a[0];
+			to[count][1] = a[1];
+			++ count;
+		}
 
-		/* Fix gaps */
-		if      (xPrevEnd   + 1 < xStart) xStart = xPrevEnd   + 1;
-		else if (xPrevStart - 1 > xEnd)   xEnd   = xPrevStart - 1;
+		if (aIn != bIn) {
+			if (a[0] > b[0] || (a[0] == b[0] && a[1] > b[1]))
+				PIF_swap(a, b);
 
-		/* Scanline */
-		if (y >= 0) {
-			for (int x = PIF_max(round(xStart), 0); x <= PIF_min(round(xEnd), self->w); ++ x)
-				PIF_imageDrawPoint(self, x, y, color);
+			double t = ((double)sign * PIF_GUARD_BAND - a[axis]) / ((double)b[axis] - a[axis]);
+			to[count][axis]  = sign * PIF_GUARD_BAND;
+			to[count][!axis] = llround(a[!axis] + t * ((double)b[!axis] - a[!axis]));
+			++ count;
 		}
+	}
+	return count;
+}
+
+/* Clips a triangle to the guard band and fills the resulting polygon as a fan */
+static void PIF_imageFillGuardedTriangle(PIF_Image *self, int x1, int y1, int x2, int y2,
+                                         int x3, int y3, uint8_t color) {
+	int ps[2][8][2] = {{{x1, y1}, {x2, y2}, {x3, y3}}}, n = 3, k = 0;
+	for (int side = 0; side < 4 && n > 0; ++ side, k = !k)
+		n = PIF_clipGuardBand(ps[k], n, ps[!k], side / 2, side % 2? -1 : 1);
 
-		/* Step */
-		xPrevEnd   = xEnd;
-		xPrevStart = xStart;
-		xStart    += slopeA;
-		xEnd      += slopeB;
+	for (int i = 1; i + 1 < n; ++ i) {
+		PIF_imageFillTriangle(self, ps[k][0][0], ps[k][0][1], ps[k][i][0], ps[k][i][1],
+		                      ps[k][i + 1][0], ps[k][i + 1][1], color);
 	}
 }
 
-/* TODO: Make triangle filling more precise? */
+/* Half-space triangle rasterizer. The bounding box is walked in 8x8 blocks, blocks outside of an
+   edge are skipped, blocks inside of all edges are filled as whole spans and only blocks on the
+   edges test each pixel. Shared edges of adjacent triangles never draw a pixel twice */
 PIF_DEF void PIF_imageFillTriangle(PIF_Image *self, int x1, int y1, int x2, int y2,
                                    int x3, int y3, uint8_t color) {
 	PIF_assert(self != NULL);
 
-	/* Sort points */
-	if (y1 > y3) {
-		PIF_swap(x1, x3);
-		PIF_swap(y1, y3);
-	}
-	if (y1 > y2) {
-		PIF_swap(x1, x2);
-		PIF_swap(y1, y2);
+	if (color == PIF_TRANSPARENT && self->skipTransparent)
+		return;
+
+	int minC = PIF_min(PIF_min(x1, PIF_min(x2, x3)), PIF_min(y1, PIF_min(y2, y3)));
+	int maxC = PIF_max(PIF_max(x1, PIF_max(x2, x3)), PIF_max(y1, PIF_max(y2, y3)));
+	if (minC < -PIF_GUARD_BAND || maxC > PIF_GUARD_BAND) {
+		PIF_imageFillGuardedTriangle(self, x1, y1, x2, y2, x3, y3, color);
+		return;
 	}
-	if (y2 > y3) {
+
+	int64_t area = ((int64_t)x2 - x1) * ((int64_t)y3 - y1) - ((int64_t)y2 - y1) * ((int64_t)x3 - x1);
+	if (area == 0)
+		return;
+	else if (area < 0) {
 		PIF_swap(x2, x3);
 		PIF_swap(y2, y3);
 	}
 
-	/* Is it a flat-sided triangle? */
-	if      (y2 == y3) PIF_imageFillFlatSideTriangle(self, x1, y1, x2, y2, x3, color, false);
-	else if (y1 == y2) PIF_imageFillFlatSideTriangle(self, x3, y3, x1, y1, x2, color, false);
-	else {
-		/* Otherwise split the triangle into 2 flat sided triangles */
-		float slope = (float)(x3 - x1) / (y3 - y1);
-		int   x4    = round((float)x3 - slope * (y3 - y2));
+	int xFrom = PIF_max(PIF_min(x1, PIF_min(x2, x3)), 0);
+	int yFrom = PIF_max(PIF_min(y1, PIF_min(y2, y3)), 0);
+	int xTo   = PIF_min(PIF_max(x1, PIF_max(x2, x3)), self->w);
+	int yTo   = PIF_min(PIF_max(y1, PIF_max(y2, y3)), self->h);
+	if (xFrom >= xTo || yFrom >= yTo)
+		return;
+
+	PIF_Edge edges[3] = {
+		PIF_edgeNew(x1, y1, x2, y2, xFrom, yFrom),
+		PIF_edgeNew(x2, y2, x3, y3, xFrom, yFrom),
+		PIF_edgeNew(x3, y3, x1, y1, xFrom, yFrom),
+	};
+
+	enum {
+		PIF_BLOCK_OUTSIDE = 0,
+		PIF_BLOCK_PARTIAL,
+		PIF_BLOCK_INSIDE,
+	};
+
+	uint8_t cover[PIF_SPAN_MAX / 8];
+	for (int by = yFrom; by < yTo; by += 8) {
+		int bh = PIF_min(yTo - by, 8);
+
+		/* Start of the span being built for each row of the band */
+		int runs[8];
+		for (int i = 0; i < 8; ++ i)
+			runs[i] = -1;
+
+		for (int cx = xFrom; cx < xTo; cx += PIF_SPAN_MAX) {
+			int cw = PIF_min(xTo - cx, PIF_SPAN_MAX);
+
+			/* Classify the blocks of this chunk by the edge values in their corners */
+			for (int i = 0; i * 8 < cw; ++ i) {
+				int bw = PIF_min(cw - i * 8, 8);
+
+				cover[i] = PIF_BLOCK_INSIDE;
+				for (int j = 0; j < 3; ++ j) {
+					PIF_Edge *edge = &edges[j];
+					int64_t   e    = edge->e + (cx + i * 8 - xFrom) * edge->stepX +
+					                           (by - yFrom) * edge->stepY;
+					int64_t   ex   = (bw - 1) * edge->stepX, ey = (bh - 1) * edge->stepY;
+
+					int64_t min = e + PIF_min(ex, 0) + PIF_min(ey, 0);
+					int64_t max = e + PIF_max(ex, 0) + PIF_max(ey, 0);
+					if (max < 0) {
+						cover[i] = PIF_BLOCK_OUTSIDE;
+						break;
+					} else if (min < 0)
+						cover[i] = PIF_BLOCK_PARTIAL;
+				}
+			}
+
+			for (int r = 0; r < bh; ++ r) {
+				int y = by + r;
+				for (int i = 0; i * 8 < cw; ++ i) {
+					int x = cx + i * 8, bw = PIF_min(cw - i * 8, 8);
+					switch (cover[i]) {
+					case PIF_BLOCK_INSIDE:
+						if (runs[r] == -1)
+							runs[r] = x;
+						break;
+
+					case PIF_BLOCK_OUTSIDE:
+						if (runs[r] != -1) {
+							PIF_imageDrawSpan(self, y, runs[r], x, NULL, color);
+							runs[r] = -1;
+						}
+						break;
+
+					case PIF_BLOCK_PARTIAL: {
+						int64_t e[3];
+						for (int j = 0; j < 3; ++ j)
+							e[j] = edges[j].e + (x - xFrom) * edges[j].stepX +
+							                    (y - yFrom) * edges[j].stepY;
+
+						for (int k = 0; k < bw; ++ k) {
+							bool inside = e[0] >= 0 && e[1] >= 0 && e[2] >= 0;
+							if (inside && runs[r] == -1)
+								runs[r] = x + k;
+							else if (!inside && runs[r] != -1) {
+								PIF_imageDrawSpan(self, y, runs[r], x + k, NULL, color);
+								runs[r] = -1;
+							}
+
+							for (int j = 0; j < 3; ++ j)
+								e[j] += edges[j].stepX;
+						}
+					} break;
+					}
+				}
+			}
+		}
 
-		PIF_imageFillFlatSideTriangle(self, x1, y1, x2, y2, x4, color, false);
-		PIF_imageFillFlatSideTriangle(self, x3, y3, x2, y2, x4, color, true);
+		for (int r = 0; r < bh; ++ r) {
+			if (runs[r] != -1)
+				PIF_imageDrawSpan(self, by + r, runs[r], xTo, NULL, color);
+		}
 	}
 }
 
@@ -1043,45 +3940,73 @@ PIF_DEF PIF_Font *PIF_fontNew(int chHeight, uint8_t *chWidths, PIF_Image *sheet,
 	return self;
 }
 
+#define PIF_FONT_HEADER (sizeof(PIF_FONT_MAGIC) - 1 + 3 + 256)
+
+typedef struct {
+	uint8_t chSpacing, lineSpacing, chHeight;
+	uint8_t chWidths[256];
+} PIF_FontHeader;
+
+/* Parses the magic bytes, spacing, character height and character widths */
+static const char *PIF_fontParseHeader(PIF_Cursor *cursor, PIF_FontHeader *header) {
+	const char *msg = PIF_cursorMagic(cursor, PIF_FONT_MAGIC, "File is not a PIF font");
+	if (msg != NULL)
+		return msg;
+
+	const uint8_t *bytes = PIF_cursorTake(cursor, 1);
+	if (bytes == NULL)
+		return "Failed to read PIF font character spacing";
+
+	header->chSpacing = *bytes;
+	if ((bytes = PIF_cursorTake(cursor, 1)) == NULL)
+		return "Failed to read PIF font line spacing";
+
+	header->lineSpacing = *bytes;
+	if ((bytes = PIF_cursorTake(cursor, 1)) == NULL)
+		return "Failed to read PIF font character height";
+
+	header->chHeight = *bytes;
+	if ((bytes = PIF_cursorTake(cursor, sizeof(header->chWidths))) == NULL)
+		return "Failed to read PIF font character widths";
+
+	memcpy(header->chWidths, bytes, sizeof(header->chWidths));
+	return NULL;
+}
+
 PIF_DEF PIF_Font *PIF_fontRead(FILE *file, const char **err) {
 	PIF_assert(file != NULL);
 
-	/* Verify magic bytes */
-	char magic[sizeof(PIF_FONT_MAGIC) - 1];
-	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic))
-		return (PIF_Font*)PIF_error(err, "Failed to read magic bytes");
+	/* The header is read in one go, then the sheet follows it */
+	uint8_t    bytes[PIF_FONT_HEADER];
+	PIF_Cursor cursor = PIF_cursorNew(bytes, fread(bytes, 1, sizeof(bytes), file));
+
+	PIF_FontHeader header;
+	const char    *msg = PIF_fontParseHeader(&cursor, &header);
+	if (msg != NULL)
+		return (PIF_Font*)PIF_error(err, msg);
 
-	if (strncmp(magic, PIF_FONT_MAGIC, sizeof(magic)) != 0)
-		return (PIF_Font*)PIF_error(err, "File is not a PIF font");
+	PIF_Image *sheet = PIF_imageRead(file, err);
+	if (sheet == NULL)
+		return NULL;
 
-	/* Read spacing */
-	int chSpacing = fgetc(file);
-	if (chSpacing == EOF)
-		return (PIF_Font*)PIF_error(err, "Failed to read PIF font character spacing");
+	return PIF_fontNew(header.chHeight, header.chWidths, sheet, header.chSpacing, header.lineSpacing);
+}
 
-	int lineSpacing = fgetc(file);
-	if (lineSpacing == EOF)
-		return (PIF_Font*)PIF_error(err, "Failed to read PIF font line spacing");
+PIF_DEF PIF_Font *PIF_fontReadMem(const void *data, size_t size, const char **err) {
+	PIF_assert(data != NULL);
 
-	/* Read character height */
-	int chHeight = fgetc(file);
-	if (chHeight == EOF)
-		return (PIF_Font*)PIF_error(err, "Failed to read PIF font character height");
+	PIF_Cursor cursor = PIF_cursorNew(data, size);
 
-	/* Read character widths */
-	uint8_t chWidths[256];
-	if (fread(chWidths, 1, sizeof(chWidths), file) != sizeof(chWidths))
-		return (PIF_Font*)PIF_error(err, "Failed to read PIF font character widths");
+	PIF_FontHeader header;
+	const char    *msg = PIF_fontParseHeader(&cursor, &header);
+	if (msg != NULL)
+		return (PIF_Font*)PIF_error(err, msg);
 
-	/* Read sheet */
-	PIF_Image *sheet = PIF_imageRead(file, err);
+	PIF_Image *sheet = PIF_imageParse(&cursor, false, true, err);
 	if (sheet == NULL)
 		return NULL;
 
-	/* Create font */
-	PIF_Font *self = PIF_fontNew(chHeight, chWidths, sheet, chSpacing, lineSpacing);
-	PIF_assert(self != NULL);
-	return self;
+	return PIF_fontNew(header.chHeight, header.chWidths, sheet, header.chSpacing, header.lineSpacing);
 }
 
 PIF_DEF PIF_Font *PIF_fontLoad(const char *path, const char **err) {
@@ -1195,26 +4120,33 @@ PIF_DEF void PIF_fontRenderChar(PIF_Font *self, char ch, PIF_Image *img,
 	if (chInfo.w == 0)
 		return;
 
-	for (int y = 0; y < round((float)self->chHeight * self->scale); ++ y) {
+	int w = round((float)chInfo.w * self->scale);
+	int h = round((float)self->chHeight * self->scale);
+
+	int xFrom = PIF_max(-xStart, 0);
+	int xTo   = PIF_min(img->w - xStart, w);
+
+	uint8_t colors[PIF_SPAN_MAX];
+	for (int y = 0; y < h; ++ y) {
 		int srcY  = chInfo.y + (float)y / self->scale;
 		int destY = yStart + y;
 		if (destY <  0)      continue;
 		if (destY >= img->h) break;
 
-		for (int x = 0; x < round((float)chInfo.w * self->scale); ++ x) {
-			int srcX = chInfo.x + (float)x / self->scale;
-
-			uint8_t *pixel = PIF_imageAt(self->sheet, srcX, srcY);
-			PIF_assert(pixel != NULL);
+		uint8_t *srcRow = PIF_imageAt(self->sheet, 0, srcY);
+		PIF_assert(srcRow != NULL);
 
-			if (*pixel == PIF_TRANSPARENT)
-				continue;
+		/* Gather the scaled character row in chunks and draw the opaque runs of each */
+		for (int x = xFrom; x < xTo; x += PIF_SPAN_MAX) {
+			int len = PIF_min(xTo - x, PIF_SPAN_MAX);
+			for (int i = 0; i < len; ++ i) {
+				int srcX = chInfo.x + (float)(x + i) / self->scale;
+				PIF_assert(srcX >= 0 && srcX < self->sheet->w);
 
-			int destX = xStart + x;
-			if (destX <  0)      continue;
-			if (destX >= img->w) break;
+				colors[i] = srcRow[srcX];
+			}
 
-			PIF_imageDrawPoint(img, destX, destY, color == PIF_TRANSPARENT? *pixel : color);
+			PIF_imageDrawRow(img, xStart + x, destY, colors, len, true, color);
 		}
 	}
 }
@@ -1335,6 +4267,16 @@ PIF_DEF PIF_Font *PIF_fontNewDefault(void) {
 #undef PIF_DEFAULT_FONT_H
 #undef PIF_DEFAULT_FONT_CHAR_H
 
+#undef PIF_SPAN_MAX
+#undef PIF_INDEX_BLOCK
+#undef PIF_TABLE_HEADER
+#undef PIF_rgbmapCell
+#undef PIF_RGBMAP_BLOCK
+#undef PIF_PALETTE_HEADER
+#undef PIF_IMAGE_HEADER_V1
+#undef PIF_IMAGE_HEADER_V2
+#undef PIF_GUARD_BAND
+#undef PIF_FONT_HEADER
 #undef PIF_error
 #undef PIF_checkAlloc
 
@@ -11,7 +11,7 @@ extern "C" {
 #include <stdint.h>  /* uint8_t, uint16_t, uint32_t */
 #include <stdbool.h> /* bool, true, false */
 #include <math.h>    /* sin, cos, round */
-#include <limits.h>  /* USHRT_MAX */
+#include <limits.h>  /* UCHAR_MAX, USHRT_MAX, INT_MAX */
 
 #ifndef PIF_alloc
 #	define PIF_alloc(SIZE) malloc(SIZE)
@@ -35,6 +35,15 @@ extern "C" {
 #	define PIF_DEF
 #endif
 
+/* Amount of threads used to generate color tables, 1 disables threading */
+#ifndef PIF_THREADS
+#	ifdef _WIN32
+#		define PIF_THREADS 1
+#	else
+#		define PIF_THREADS 4
+#	endif
+#endif
+
 #define PIF_COLORS         256
 #define PIF_TRANSPARENT    0
 #define PIF_DEFAULT_SHADES 64
@@ -42,13 +51,16 @@ extern "C" {
 #define PIF_STD_BLACK 1
 #define PIF_STD_WHITE 2
 
-#define PIF_PALETTE_MAGIC "PIFP"
-#define PIF_IMAGE_MAGIC   "PIFI"
-#define PIF_FONT_MAGIC    "PIFF"
+#define PIF_PALETTE_MAGIC  "PIFP"
+#define PIF_IMAGE_MAGIC    "PIFI" /* Version 1 images */
+#define PIF_IMAGE_MAGIC_V2 "PIFV" /* Images with a version field, starting at version 2 */
+#define PIF_FONT_MAGIC     "PIFF"
+#define PIF_TABLE_MAGIC    "PIFT"
 
 #define PIF_PALETTE_EXT "pal"
 #define PIF_IMAGE_EXT   "pif" /* Palettized Image File */
 #define PIF_FONT_EXT    "pbf" /* Palettized Bitmap Font */
+#define PIF_TABLE_EXT   "pit" /* Palettized Image Table */
 
 typedef struct PIF_Image PIF_Image;
 
@@ -66,6 +78,8 @@ typedef struct {
 PIF_DEF int      PIF_rgbDiff(PIF_Rgb a, PIF_Rgb b);
 PIF_DEF PIF_Rgb  PIF_rgbLerp(PIF_Rgb a, PIF_Rgb b, float t);
 PIF_DEF uint8_t  PIF_rgbToColor(PIF_Rgb rgb, PIF_Image *rgbmap);
+PIF_DEF void     PIF_rgbToColorBuffer(const PIF_Rgb *rgbs, uint8_t *colors, int count,
+                                      PIF_Image *rgbmap);
 PIF_DEF uint32_t PIF_rgbToPixelRgba32(PIF_Rgb self);
 PIF_DEF uint32_t PIF_rgbToPixelAbgr32(PIF_Rgb self);
 PIF_DEF PIF_Rgb  PIF_rgbFromPixelRgba32(uint32_t pixel);
@@ -78,6 +92,7 @@ typedef struct {
 
 PIF_DEF PIF_Palette *PIF_paletteNew  (int   size);
 PIF_DEF PIF_Palette *PIF_paletteRead (FILE *file,        const char **err);
+PIF_DEF PIF_Palette *PIF_paletteReadMem(const void *data, size_t size, const char **err);
 PIF_DEF PIF_Palette *PIF_paletteLoad (const char  *path, const char **err);
 PIF_DEF void         PIF_paletteWrite(PIF_Palette *self, FILE        *file);
 PIF_DEF int          PIF_paletteSave (PIF_Palette *self, const char  *path);
@@ -92,14 +107,104 @@ PIF_DEF void         PIF_paletteFree (PIF_Palette *self);
 
 PIF_DEF uint8_t    PIF_paletteClosest(PIF_Palette *self, PIF_Rgb rgb);
 PIF_DEF PIF_Image *PIF_paletteCreateColormap(PIF_Palette *self, int shades, float t);
+/* Lazy colormaps only generate the shade rows up front, a blend row is allocated and generated
+   the first time PIF_blendColor or the blend shaders use it. PIF_shadeColor and PIF_blendColor
+   are safe to use before a build. Until PIF_colormapBuild gathers every row into the pixels,
+   they only hold the shade rows, so access them directly only after calling it. Image functions
+   which use every pixel call it themselves */
+PIF_DEF PIF_Image *PIF_paletteCreateLazyColormap(PIF_Palette *self, int shades, float t);
+PIF_DEF void       PIF_colormapBuild(PIF_Image *colormap);
+
+#define PIF_TABLE_COLORMAP 0
+#define PIF_TABLE_RGBMAP   1
+
+/* Identifies the generated table stored in a table file. param is the amount of shades of a
+   colormap or the size of an rgbmap, t is only used by colormaps */
+typedef struct {
+	uint32_t type, paletteHash, param;
+	float    t;
+} PIF_TableKey;
+
+PIF_DEF uint32_t     PIF_paletteHash(PIF_Palette *self);
+PIF_DEF PIF_TableKey PIF_colormapKey(PIF_Palette *pal, int shades, float t);
+PIF_DEF PIF_TableKey PIF_rgbmapKey  (PIF_Palette *pal, uint8_t size);
+
+/* Maps a table file read-only, the returned image shares the file's pages and must not be
+   drawn on. Returns NULL if the file is missing, invalid or stored with a different key */
+PIF_DEF PIF_Image *PIF_tableMap (const char *path, PIF_TableKey *key, const char **err);
+PIF_DEF void       PIF_tableWrite(PIF_Image *table, PIF_TableKey *key, FILE *file);
+PIF_DEF int        PIF_tableSave (PIF_Image *table, PIF_TableKey *key, const char *path);
+
+/* Map the table from the cache file at path, or generate it and save it there if the cached one
+   is missing or stale */
+PIF_DEF PIF_Image *PIF_paletteLoadColormap(PIF_Palette *self, int shades, float t, const char *path);
+PIF_DEF PIF_Image *PIF_paletteLoadRgbmap  (PIF_Palette *self, uint8_t size, const char *path);
 PIF_DEF PIF_Image *PIF_paletteCreateRgbmap(PIF_Palette *self, uint8_t size);
 
+/* Nearest color search structure. The opaque colors are stored as interleaved 16-bit channels,
+   so several color differences can be computed with a single multiply-add instruction. size is
+   count rounded up to the SIMD block size */
+typedef struct {
+	int     size, count;
+	int16_t rg[PIF_COLORS * 2], b0[PIF_COLORS * 2];
+	uint8_t color[PIF_COLORS];
+} PIF_PaletteIndex;
+
+PIF_DEF PIF_PaletteIndex *PIF_paletteIndexNew    (PIF_Palette *palette);
+PIF_DEF void              PIF_paletteIndexFree   (PIF_PaletteIndex *self);
+PIF_DEF uint8_t           PIF_paletteIndexClosest(PIF_PaletteIndex *self, PIF_Rgb rgb);
+
+/* Maps every color of one palette to the closest color of another, built once and applied to
+   any amount of images */
+typedef struct {
+	uint8_t map[PIF_COLORS];
+} PIF_Remap;
+
+PIF_DEF PIF_Remap *PIF_remapNew  (PIF_Palette *from, PIF_Palette *to);
+PIF_DEF void       PIF_remapFree (PIF_Remap   *self);
+PIF_DEF void       PIF_remapApply(PIF_Remap   *self, uint8_t *buf, int size);
+
+#define PIF_OUTPUT_RGBA8888 0
+#define PIF_OUTPUT_ABGR8888 1
+#define PIF_OUTPUT_ARGB8888 2
+#define PIF_OUTPUT_RGB565   3
+
+/* Converts images to a true color pixel format through a table of the packed pixel of every
+   color. Transparent pixels become 0. RGB565 pixels are 16 bits wide, the others 32 bits. Call
+   PIF_outputUpdate after changing the palette */
+typedef struct {
+	int      format, bytes;
+	uint32_t lut[PIF_COLORS];
+} PIF_Output;
+
+PIF_DEF PIF_Output *PIF_outputNew   (PIF_Palette *pal,  int format);
+PIF_DEF void        PIF_outputUpdate(PIF_Output  *self, PIF_Palette *pal);
+PIF_DEF void        PIF_outputFree  (PIF_Output  *self);
+/* Writes the pixels of rect (or the whole image if NULL) to pixels, which holds rows of pitch
+   bytes starting at the top left corner of rect */
+PIF_DEF void        PIF_outputConvert(PIF_Output *self, PIF_Image *img, PIF_Rect *rect,
+                                      void *pixels, int pitch);
+/* Same as PIF_outputConvert, but every pixel becomes a scale by scale block of pixels */
+PIF_DEF void        PIF_outputConvertScaled(PIF_Output *self, PIF_Image *img, PIF_Rect *rect,
+                                            int scale, void *pixels, int pitch);
+
 typedef void (*PIF_Shader)(int, int, uint8_t*, uint8_t, PIF_Image*);
 
+/* Span shaders shade the pixels row[x0] to row[x1 - 1] of the row y in one call. If colors is not
+   NULL, colors[x - x0] is the color of the pixel x, otherwise all of the pixels use color */
+typedef void (*PIF_SpanShader)(int, int, int, uint8_t*, const uint8_t*, uint8_t, PIF_Image*);
+
 PIF_DEF void PIF_blendShader (int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img);
 PIF_DEF void PIF_ditherShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img);
 PIF_DEF void PIF_copyShader  (int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img);
 
+PIF_DEF void PIF_blendSpanShader (int y, int x0, int x1, uint8_t *row, const uint8_t *colors,
+                                  uint8_t color, PIF_Image *img);
+PIF_DEF void PIF_ditherSpanShader(int y, int x0, int x1, uint8_t *row, const uint8_t *colors,
+                                  uint8_t color, PIF_Image *img);
+PIF_DEF void PIF_copySpanShader  (int y, int x0, int x1, uint8_t *row, const uint8_t *colors,
+                                  uint8_t color, PIF_Image *img);
+
 typedef struct {
 	PIF_Image *src;
 	PIF_Rect   srcRect, destRect;
@@ -112,20 +217,76 @@ typedef struct {
 
 PIF_DEF void PIF_exCopyShader(int x, int y, uint8_t *pixel, uint8_t color, PIF_Image *img);
 
-struct PIF_Image {
-	PIF_Shader shader;
-	void      *data;
-	bool       skipTransparent;
+#define PIF_DIRTY_RECTS 8
+
+/* The parts of an image drawn on since the last reset, as up to PIF_DIRTY_RECTS rects which may
+   overlap. Touching rects are merged, and once the list is full new rects are merged into the
+   one that grows the least */
+typedef struct {
+	bool     track;
+	int      count;
+	PIF_Rect rects[PIF_DIRTY_RECTS];
+} PIF_Dirty;
+
+#define PIF_IMAGE_VERSION 2
+
+/* Image file flags */
+#define PIF_IMAGE_PALETTE (1 << 0) /* paletteHash is the hash of the palette the image is for */
+#define PIF_IMAGE_RLE     (1 << 1) /* The pixels are the row table and runs of a PIF_Sprite */
+
+/* Version 1 image files only store a 16-bit size. Version 2 files store 32-bit sizes and a
+   CRC-32C of the h * pitch pixel bytes, which start 64 bytes into the file. They have their own
+   magic, so readers which only know version 1 reject them */
+typedef struct {
+	int      version, w, h, pitch;
+	uint32_t flags, paletteHash, crc;
+} PIF_ImageHeader;
 
-	int     w, h, size;
-	uint8_t buf[1];
+struct PIF_Image {
+	PIF_Shader     shader;
+	PIF_SpanShader spanShader;
+	void          *data;
+	bool           skipTransparent;
+	void          *lazy; /* Generation state of a lazy colormap */
+	void          *map;  /* Read-only file mapping which holds buf, if the image is mapped */
+	size_t         mapSize;
+	PIF_Dirty      dirty;
+
+	/* size is the amount of pixels, the rows are pitch bytes apart in buf */
+	int      w, h, size, pitch;
+	uint8_t *buf;
 };
 
 PIF_DEF PIF_Image *PIF_imageNew  (int w, int h);
+/* Images using existing pixels, which are not copied or freed with the image. Const pixels, like
+   baked tables, must not be drawn on. The rows of a pitch view are pitch bytes apart, like the
+   rows of a locked texture */
+PIF_DEF PIF_Image *PIF_imageView     (int w, int h, const uint8_t *buf);
+PIF_DEF PIF_Image *PIF_imagePitchView(int w, int h, int pitch, const uint8_t *buf);
+/* View of a rect of an image, which shares its pixels and drawing settings. It is returned by
+   value so it costs nothing to create, and must not be freed, resized or outlive the image.
+   Drawing on the view does not mark the image as dirty */
+PIF_DEF PIF_Image  PIF_imageSubView  (PIF_Image *self, PIF_Rect *rect);
+/* Reads the header of an image file, leaving the file at the pixels. Returns -1 on failure */
+PIF_DEF int        PIF_imageReadHeader(FILE       *file, PIF_ImageHeader *header, const char **err);
+PIF_DEF int        PIF_imageLoadHeader(const char *path, PIF_ImageHeader *header, const char **err);
+/* Reads version 1 and 2 image files, the checksum of version 2 files is verified. Compressed
+   images are decoded */
 PIF_DEF PIF_Image *PIF_imageRead (FILE       *file, const char **err);
+/* Reads an image from a buffer holding a whole image file. A borrowed image uses the pixels in the
+   buffer like a view instead of copying them */
+PIF_DEF PIF_Image *PIF_imageReadMem(const void *data, size_t size, bool borrow, const char **err);
 PIF_DEF PIF_Image *PIF_imageLoad (const char *path, const char **err);
+/* Maps an image file read-only, the image uses the pixels in the mapping and must not be drawn
+   on. The pages are shared with other processes mapping the same file and are only read when
+   used, unless populate is set. The checksum is not verified, as that would read every page.
+   The mapping is released when the image is freed. Compressed images are decoded instead */
+PIF_DEF PIF_Image *PIF_imageMap  (const char *path, bool populate, const char **err);
+/* Writes a version 2 image file. Writing with a palette stores its hash in the header */
 PIF_DEF void       PIF_imageWrite(PIF_Image  *self, FILE        *file);
 PIF_DEF int        PIF_imageSave (PIF_Image  *self, const char  *path);
+PIF_DEF void       PIF_imageWriteWithPalette(PIF_Image *self, PIF_Palette *pal, FILE       *file);
+PIF_DEF int        PIF_imageSaveWithPalette (PIF_Image *self, PIF_Palette *pal, const char *path);
 PIF_DEF void       PIF_imageFree (PIF_Image  *self);
 
 #define PIF_imagesFree(...)                                              \
@@ -135,11 +296,58 @@ PIF_DEF void       PIF_imageFree (PIF_Image  *self);
 			PIF_imageFree(imgs_[i]);                                     \
 	} while (0)
 
+/* Reads or writes the rows of an image file in bands, so images larger than memory can be
+   processed with a bounded amount of it. Streamed images only have to fit the header, not
+   INT_MAX pixels. Writers patch the height and checksum into the header when closed, so their
+   file has to be seekable */
+typedef struct {
+	FILE           *file;
+	bool            owned, writing;
+	long            start; /* Position of the header in the file */
+	PIF_ImageHeader header;
+	int             y;     /* Rows read or written so far */
+	uint32_t        crc;
+} PIF_ImageStream;
+
+/* Band filters get bands as images, y is the row of the top of the band in the whole image */
+typedef void (*PIF_BandFilter)(PIF_Image*, int, void*);
+
+PIF_DEF PIF_ImageStream *PIF_imageStreamRead  (FILE       *file, const char **err);
+PIF_DEF PIF_ImageStream *PIF_imageStreamOpen  (const char *path, const char **err);
+PIF_DEF PIF_ImageStream *PIF_imageStreamWrite (FILE       *file, int w, PIF_Palette *pal);
+PIF_DEF PIF_ImageStream *PIF_imageStreamCreate(const char *path, int w, PIF_Palette *pal,
+                                               const char **err);
+/* Reads up to rows rows into buf, which has rows pitch bytes apart. Returns the amount of rows
+   read, 0 after the last row or -1 on failure. The checksum is verified with the last band */
+PIF_DEF int  PIF_imageStreamReadBand (PIF_ImageStream *self, uint8_t *buf, int pitch, int rows,
+                                      const char **err);
+PIF_DEF void PIF_imageStreamWriteBand(PIF_ImageStream *self, const uint8_t *buf, int pitch,
+                                      int rows);
+/* Returns -1 if the header of a writer could not be patched or the file could not be closed.
+   Files given to PIF_imageStreamRead and PIF_imageStreamWrite are left open */
+PIF_DEF int  PIF_imageStreamClose    (PIF_ImageStream *self);
+/* Runs filter on the remaining rows of in, in bands of up to rows rows, and writes the filtered
+   bands to out unless it is NULL. Returns 0 on success or -1 on failure */
+PIF_DEF int  PIF_imageStreamFilter(PIF_ImageStream *in, PIF_ImageStream *out, int rows,
+                                   PIF_BandFilter filter, void *data, const char **err);
+PIF_DEF int  PIF_imageStreamRemap (PIF_ImageStream *in, PIF_ImageStream *out, int rows,
+                                   PIF_Remap *remap, const char **err);
+
 PIF_DEF void PIF_imageSkipTransparent(PIF_Image *self, bool enable);
 
+/* Dirty tracking is disabled by default. Enabling it marks the whole image as dirty, so the first
+   update after it covers everything. Changes made to buf directly have to be marked by hand */
+PIF_DEF void PIF_imageTrackDirty (PIF_Image *self, bool enable);
+PIF_DEF void PIF_imageMarkDirty  (PIF_Image *self, PIF_Rect *rect);
+PIF_DEF void PIF_imageResetDirty (PIF_Image *self);
+/* Returns false if nothing is dirty, otherwise bounds is set to the bounds of the dirty rects */
+PIF_DEF bool PIF_imageDirtyBounds(PIF_Image *self, PIF_Rect *bounds);
+
 PIF_DEF void       PIF_imageSetShader     (PIF_Image *self, PIF_Shader shader, void *data);
+PIF_DEF void       PIF_imageSetSpanShader (PIF_Image *self, PIF_SpanShader spanShader, void *data);
 PIF_DEF void       PIF_imageSetShaderData (PIF_Image *self, void *data);
 PIF_DEF void       PIF_imageConvertPalette(PIF_Image *self, PIF_Palette *from, PIF_Palette *to);
+PIF_DEF void       PIF_imageRemap         (PIF_Image *self, PIF_Remap *remap);
 PIF_DEF uint8_t   *PIF_imageAt(PIF_Image *self, int x, int y);
 PIF_DEF PIF_Image *PIF_imageResize(PIF_Image *self, int w, int h, uint8_t color);
 PIF_DEF PIF_Image *PIF_imageCopy  (PIF_Image *self, PIF_Image *from);
@@ -167,6 +375,8 @@ PIF_DEF void PIF_imageDrawRotateRect(PIF_Image *self, PIF_Rect *rect, int n, uin
 
 PIF_DEF void PIF_imageFillRect    (PIF_Image *self, PIF_Rect *rect, uint8_t color);
 PIF_DEF void PIF_imageFillCircle  (PIF_Image *self, int cx, int cy, int r, uint8_t color);
+/* Triangles reaching past 2^28 on either axis are clipped to that range first, so pixels past it
+   are never filled */
 PIF_DEF void PIF_imageFillTriangle(PIF_Image *self, int x1, int y1, int x2, int y2,
                                    int x3, int y3, uint8_t color);
 PIF_DEF void PIF_imageFillTransformRect(PIF_Image *self, PIF_Rect *rect, uint8_t color,
@@ -174,6 +384,32 @@ PIF_DEF void PIF_imageFillTransformRect(PIF_Image *self, PIF_Rect *rect, uint8_t
 PIF_DEF void PIF_imageFillRotateRect(PIF_Image *self, PIF_Rect *rect, uint8_t color,
                                      float angle, int cx, int cy);
 
+/* Run length encoded images, which skip transparent pixels without reading them when drawn. A
+   run is a byte holding the amount of transparent pixels to skip and a byte holding the amount
+   of opaque pixels, followed by their colors. The runs of the row y are the bytes rows[y] to
+   rows[y + 1] - 1 of runs, and transparent pixels after the last run are not stored */
+typedef struct {
+	int       w, h;
+	uint32_t *rows;
+	uint8_t  *runs;
+} PIF_Sprite;
+
+/* Encodes rect of an image, or the whole image if rect is NULL */
+PIF_DEF PIF_Sprite *PIF_spriteNew    (PIF_Image  *img,  PIF_Rect   *rect);
+/* Reads compressed image files, uncompressed ones are encoded */
+PIF_DEF PIF_Sprite *PIF_spriteRead   (FILE       *file, const char **err);
+PIF_DEF PIF_Sprite *PIF_spriteReadMem(const void *data, size_t size, const char **err);
+PIF_DEF PIF_Sprite *PIF_spriteLoad   (const char *path, const char **err);
+/* Writes a version 2 image file with the PIF_IMAGE_RLE flag */
+PIF_DEF void        PIF_spriteWrite  (PIF_Sprite *self, FILE       *file);
+PIF_DEF int         PIF_spriteSave   (PIF_Sprite *self, const char *path);
+PIF_DEF PIF_Image  *PIF_spriteToImage(PIF_Sprite *self);
+PIF_DEF void        PIF_spriteFree   (PIF_Sprite *self);
+
+/* Draws a sprite with its top left corner at x, y. Transparent runs are drawn too if the image
+   does not skip transparent pixels, so it matches PIF_imageBlit of the encoded image */
+PIF_DEF void PIF_imageBlitSprite(PIF_Image *self, PIF_Sprite *sprite, int x, int y);
+
 typedef struct {
 	uint8_t x, y, w;
 } PIF_FontCharInfo;
@@ -190,6 +426,7 @@ typedef struct {
 PIF_DEF PIF_Font *PIF_fontNew(int chHeight, uint8_t *chWidths, PIF_Image *sheet,
                               uint8_t chSpacing, uint8_t lineSpacing);
 PIF_DEF PIF_Font *PIF_fontRead (FILE       *file,  const char **err);
+PIF_DEF PIF_Font *PIF_fontReadMem(const void *data, size_t size, const char **err);
 PIF_DEF PIF_Font *PIF_fontLoad (const char *path,  const char **err);
 PIF_DEF void      PIF_fontWrite(PIF_Font   *self,  FILE        *file);
 PIF_DEF int       PIF_fontSave (PIF_Font   *self,  const char  *path);